@@ -0,0 +1,351 @@
+/* Copyright 2016 Laurent Van Begin
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE OpenSSL PROJECT ``AS IS'' AND ANY
+ * EXPRESSED OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE OpenSSL PROJECT OR
+ * ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+  */
+
+#include <iostream>
+#include <chrono>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <thread>
+#include <numeric>
+#include <algorithm>
+#include <cmath>
+
+#include <threadpool.h>
+#include <threadCache.h>
+#include <map.h>
+#include <reduce.h>
+#include <sort.h>
+
+using namespace threadpool;
+
+/* Every benchmark is repeated nbRepetitions times (after one warm-up run) and reports
+ * percentiles over its samples, one JSON object per line:
+ * {"benchmark": ..., "unit": ..., "samples": ..., "mean": ..., "p50": ..., "p90": ..., "p99": ..., "max": ...}
+ * The work of one repetition is kept small so that every series has the 100 samples p99
+ * needs; report() leaves out p90 below 10 samples and p99 below 100, where they would
+ * only repeat the max. Thread counts go up to maxThreads, the number of
+ * hardware threads unless given on the command line. */
+static const unsigned int nbRepetitions = 100;
+static unsigned int maxThreads = std::max(1u, std::thread::hardware_concurrency());
+
+typedef std::chrono::steady_clock benchClock;
+
+static double nanoseconds(benchClock::duration elapsed) {
+	return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+}
+
+static void report(const std::string &benchmark, const char *unit, std::vector<double> samples) {
+	std::sort(samples.begin(), samples.end());
+	const auto at = [&samples](double rank) { return samples[std::min(samples.size() - 1, static_cast<size_t>(rank * samples.size()))]; };
+	const double mean = std::accumulate(samples.begin(), samples.end(), 0.0) / samples.size();
+
+	std::cout << "{\"benchmark\": \"" << benchmark << "\", \"unit\": \"" << unit << "\", \"samples\": " << samples.size()
+		  << ", \"mean\": " << mean << ", \"p50\": " << at(0.5);
+	if (samples.size() >= 10)
+		std::cout << ", \"p90\": " << at(0.9);
+	if (samples.size() >= 100)
+		std::cout << ", \"p99\": " << at(0.99);
+	std::cout << ", \"max\": " << samples.back() << "}" << std::endl;
+}
+
+/* Runs f (returning one sample) a warm-up time, then nbRepetitions times. */
+template <typename F>
+static std::vector<double> repeat(F f) {
+	std::vector<double> samples;
+
+	f();
+	for (unsigned int i = 0; i < nbRepetitions; i++)
+		samples.push_back(f());
+	return samples;
+}
+
+/* Queue throughput: producers push nbMessages messages in total while consumers pop them. */
+template <template <typename> class Queue>
+static double queueThroughput(unsigned int nbProducers, unsigned int nbConsumers, size_t capacity) {
+	static const unsigned int nbMessages = 40000;
+	Queue<unsigned int> queue(capacity);
+	std::vector<std::thread> threads;
+
+	const auto start = benchClock::now();
+	for (unsigned int i = 0; i < nbConsumers; i++)
+		threads.emplace_back([&queue]() {
+			try {
+				for ( ; ; )
+					queue.pop();
+			}
+			catch (ThreadSafeQueueEmpty &e) { }
+		});
+	std::vector<std::thread> producers;
+	for (unsigned int i = 0; i < nbProducers; i++)
+		producers.emplace_back([&queue, nbProducers, i]() {
+			for (unsigned int m = i; m < nbMessages; m += nbProducers)
+				queue.push(m);
+		});
+	for (auto &p : producers)
+		p.join();
+	queue.terminate();
+	for (auto &c : threads)
+		c.join();
+	return nanoseconds(benchClock::now() - start) / nbMessages;
+}
+
+template <template <typename> class Queue>
+static void queue__throughput(const char *name) {
+	static const unsigned int ratios[][2] = { { 1, 1 }, { 1, 4 }, { 4, 1 }, { 4, 4 } };
+	static const size_t capacities[] = { 16, 1024 };
+
+	for (const auto &ratio : ratios)
+		for (size_t capacity : capacities)
+			report(std::string("queue/throughput/") + name + "/p" + std::to_string(ratio[0]) + "c" + std::to_string(ratio[1]) + "/cap" + std::to_string(capacity),
+				"ns/message", repeat([&ratio, capacity]() { return queueThroughput<Queue>(ratio[0], ratio[1], capacity); }));
+}
+
+/* Queue latency: round trip of one message between two threads through two queues. */
+template <template <typename> class Queue>
+static void queue__latency(const char *name) {
+	static const unsigned int nbRoundTrips = 20000;
+	Queue<unsigned int> ping(16), pong(16);
+	std::vector<double> samples;
+
+	std::thread echo([&ping, &pong]() {
+		try {
+			for ( ; ; )
+				pong.push(ping.pop());
+		}
+		catch (ThreadSafeQueueEmpty &e) { }
+	});
+	samples.reserve(nbRoundTrips);
+	for (unsigned int i = 0; i < nbRoundTrips; i++) {
+		const auto start = benchClock::now();
+		ping.push(i);
+		pong.pop();
+		samples.push_back(nanoseconds(benchClock::now() - start));
+	}
+	ping.terminate();
+	echo.join();
+	report(std::string("queue/latency/") + name, "ns/round-trip", samples);
+}
+
+static void queue__all(ThreadCache &) {
+	queue__throughput<ThreadSafeBoundedQueue>("locked");
+	queue__throughput<LockFreeBoundedQueue>("lock-free");
+	queue__latency<ThreadSafeBoundedQueue>("locked");
+	queue__latency<LockFreeBoundedQueue>("lock-free");
+}
+
+/* Per message cost of a pool: messages are added from one thread and the time includes
+ * draining the pool. */
+template <typename Pool>
+static double feed(std::unique_ptr<Pool> pool, unsigned int nbMessages) {
+	const auto start = benchClock::now();
+	for (unsigned int i = 0; i < nbMessages; i++)
+		pool->add(i);
+	pool.reset(nullptr);
+	return nanoseconds(benchClock::now() - start) / nbMessages;
+}
+
+template <typename Body>
+static void overhead(const std::string &name, Body body, unsigned int nbMessages, ThreadCache &cache) {
+	for (unsigned int nbThreads = 1; nbThreads <= cache.getSize(); nbThreads *= 2) {
+		const std::string suffix = "/threads" + std::to_string(nbThreads);
+		report("pool/overhead/" + name + "/std::function" + suffix, "ns/message", repeat([&]() {
+			return feed(std::make_unique<Threadpool<unsigned int, LockFreeBoundedQueue>>(doNothing, body, doNothing, nbThreads, 1024, cache), nbMessages);
+		}));
+		report("pool/overhead/" + name + "/inlined" + suffix, "ns/message", repeat([&]() {
+			return feed(makeStaticThreadpool<unsigned int, LockFreeBoundedQueue>([]() { }, body, []() { }, nbThreads, 1024, cache), nbMessages);
+		}));
+	}
+}
+
+static void pool__overhead(ThreadCache &cache) {
+	std::atomic<unsigned long> sum {0};
+
+	overhead("empty", [](unsigned int) { }, 100000, cache);
+	overhead("tiny", [&sum](unsigned int m) { sum.fetch_add(m * 3 + 1, std::memory_order_relaxed); }, 100000, cache);
+	overhead("heavy", [&sum](unsigned int m) {
+		double x = m;
+		for (unsigned int i = 0; i < 2000; i++)
+			x = std::sqrt(x + i);
+		sum.fetch_add(static_cast<unsigned long>(x), std::memory_order_relaxed);
+	}, 4000, cache);
+}
+
+/* Latency of leasing one thread while nbClients threads lease from the same cache. */
+static void cache__lease(ThreadCache &cache) {
+	static const unsigned int nbLeases = 5000;
+
+	for (unsigned int nbClients = 1; nbClients <= 2 * cache.getSize(); nbClients *= 2) {
+		std::vector<std::vector<double>> latencies(nbClients);
+		std::vector<std::thread> clients;
+		for (unsigned int c = 0; c < nbClients; c++)
+			clients.emplace_back([&cache, &latencies, c]() {
+				latencies[c].reserve(nbLeases);
+				for (unsigned int i = 0; i < nbLeases; i++) {
+					const auto start = benchClock::now();
+					cache.lease(1, []() { });
+					latencies[c].push_back(nanoseconds(benchClock::now() - start));
+				}
+			});
+		for (auto &c : clients)
+			c.join();
+		std::vector<double> samples;
+		for (const auto &l : latencies)
+			samples.insert(samples.end(), l.begin(), l.end());
+		report("cache/lease/clients" + std::to_string(nbClients), "ns/lease", samples);
+	}
+}
+
+/* map and associativeReduce against their sequential counterpart; the parallel runs use
+ * a cache of the given size. */
+static void map__scaling(ThreadCache &) {
+	static const size_t size = 1 << 18;
+	std::vector<double> input(size), output(size);
+	const auto f = [](double x) { return std::sqrt(x) * 1.5 + 1.0; };
+
+	std::iota(input.begin(), input.end(), 0.0);
+	report("map/sequential", "ns/element", repeat([&]() {
+		const auto start = benchClock::now();
+		std::transform(input.begin(), input.end(), output.begin(), f);
+		return nanoseconds(benchClock::now() - start) / size;
+	}));
+	for (unsigned int nbThreads = 1; nbThreads <= maxThreads; nbThreads *= 2) {
+		ThreadCache cache(nbThreads);
+		report("map/parallel/threads" + std::to_string(nbThreads), "ns/element", repeat([&]() {
+			const auto start = benchClock::now();
+			map(input.begin(), input.end(), output.begin(), f, cache);
+			return nanoseconds(benchClock::now() - start) / size;
+		}));
+	}
+	static const size_t phaseSize = 1024;
+	static const int nbPhases = 1000;
+	ThreadCache cache(maxThreads);
+	/* One sample per phase. */
+	const auto phases = [&](auto &workers) {
+		std::vector<double> samples;
+
+		samples.reserve(nbPhases);
+		for (int phase = 0; phase < nbPhases; phase++) {
+			const auto start = benchClock::now();
+			map(input.begin(), input.begin() + phaseSize, output.begin(), f, workers);
+			samples.push_back(nanoseconds(benchClock::now() - start));
+		}
+		return samples;
+	};
+	report("map/phase/cache", "ns/phase", phases(cache));
+	WorkerTeam team(maxThreads, cache);
+	report("map/phase/team", "ns/phase", phases(team));
+}
+
+static void reduce__scaling(ThreadCache &) {
+	static const size_t size = 1 << 20;
+	std::vector<long> input(size);
+	volatile long result;
+
+	std::iota(input.begin(), input.end(), 0);
+	report("reduce/sequential", "ns/element", repeat([&]() {
+		const auto start = benchClock::now();
+		result = std::accumulate(input.begin(), input.end(), 0L);
+		return nanoseconds(benchClock::now() - start) / size;
+	}));
+	for (unsigned int nbThreads = 1; nbThreads <= maxThreads; nbThreads *= 2) {
+		ThreadCache cache(nbThreads);
+		report("reduce/associative/threads" + std::to_string(nbThreads), "ns/element", repeat([&]() {
+			const auto start = benchClock::now();
+			result = associativeReduce(input.begin(), input.end(), 0L, [](long a, long b) { return a + b; }, cache);
+			return nanoseconds(benchClock::now() - start) / size;
+		}));
+		report("reduce/mapThenReduce/threads" + std::to_string(nbThreads), "ns/element", repeat([&]() {
+			const auto start = benchClock::now();
+			std::vector<long> squares(size);
+			map(input.begin(), input.end(), squares.begin(), [](long x) { return x * x; }, cache);
+			result = associativeReduce(squares.begin(), squares.end(), 0L, [](long a, long b) { return a + b; }, cache);
+			return nanoseconds(benchClock::now() - start) / size;
+		}));
+		report("reduce/transformReduce/threads" + std::to_string(nbThreads), "ns/element", repeat([&]() {
+			const auto start = benchClock::now();
+			result = transformReduce(input.begin(), input.end(), 0L, [](long x) { return x * x; }, [](long a, long b) { return a + b; }, cache);
+			return nanoseconds(benchClock::now() - start) / size;
+		}));
+	}
+	(void) result;
+}
+
+static void sort__scaling(ThreadCache &) {
+	static const size_t size = 1 << 19;
+	std::vector<unsigned int> input(size), v;
+	unsigned int seed = 1;
+
+	for (auto &e : input)
+		e = (seed = seed * 1103515245 + 12345);
+	report("sort/sequential", "ns/element", repeat([&]() {
+		v = input;
+		const auto start = benchClock::now();
+		std::sort(v.begin(), v.end());
+		return nanoseconds(benchClock::now() - start) / size;
+	}));
+	for (unsigned int nbThreads = 1; nbThreads <= maxThreads; nbThreads *= 2) {
+		ThreadCache cache(nbThreads);
+		report("sort/parallel/threads" + std::to_string(nbThreads), "ns/element", repeat([&]() {
+			v = input;
+			const auto start = benchClock::now();
+			parallelSort(v.begin(), v.end(), cache);
+			return nanoseconds(benchClock::now() - start) / size;
+		}));
+	}
+}
+
+struct bench_t {
+	const char *name;
+	void (*run)(ThreadCache &);
+};
+
+/* Usage: threadpoolBench [name [maxThreads]] runs the benchmark groups matching name
+ * (e.g. "queue"; "" for all of them) with up to maxThreads threads. */
+int main(int argc, char *argv[])
+{
+	static const bench_t benches[] = {
+		{ "queue", queue__all },
+		{ "pool", pool__overhead },
+		{ "cache", cache__lease },
+		{ "map", map__scaling },
+		{ "reduce", reduce__scaling },
+		{ "sort", sort__scaling },
+		{ nullptr, nullptr },
+	};
+	const std::string filter = (argc > 1) ? argv[1] : "";
+	if (argc > 2)
+		maxThreads = std::max(1, std::stoi(argv[2]));
+	ThreadCache cache(maxThreads);
+
+	for (const bench_t *bench = benches; nullptr != bench->name; bench++)
+		if (0 == filter.compare(0, std::string::npos, bench->name, std::min(filter.size(), std::string(bench->name).size())))
+			bench->run(cache);
+	return 0;
+}
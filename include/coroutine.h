@@ -0,0 +1,383 @@
+/* Copyright 2016 Laurent Van Begin
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE OpenSSL PROJECT ``AS IS'' AND ANY
+ * EXPRESSED OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE OpenSSL PROJECT OR
+ * ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+  */
+
+#ifndef COROUTINE_H__
+#define COROUTINE_H__
+
+/* configure defines THREADPOOL_COROUTINES when it selects -std=c++20; other builds
+ * get the coroutine layer whenever the compiler supports it. */
+#if !defined(THREADPOOL_COROUTINES) && defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#define THREADPOOL_COROUTINES 1
+#endif
+
+#ifdef THREADPOOL_COROUTINES
+
+#include <threadpool.h>
+#include <coroutine>
+#include <optional>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+namespace threadpool {
+
+/* Runs coroutines on threads of a cache. The workers pop coroutine handles and resume
+ * them directly: resuming on a worker neither allocates nor goes through a callback. */
+class CoroutineScheduler {
+public:
+	explicit CoroutineScheduler(unsigned int poolSize, size_t waitingQueueSize, ThreadCache &threadCache) :
+					handles(waitingQueueSize), nbThreads(poolSize) {
+		handles.setWaitStrategy(threadCache.getWaitStrategy());
+		threadCache.lease(poolSize, [this]() { run(); });
+	}
+	~CoroutineScheduler(void) { nbThreads.terminate(handles); }
+
+	/* co_await schedule() resumes the coroutine on a worker, waiting for room in the
+	 * queue when it is full. */
+	auto schedule(void) {
+		struct awaitable {
+			CoroutineScheduler &scheduler;
+			bool await_ready(void) const noexcept { return false; }
+			void await_suspend(std::coroutine_handle<> h) { scheduler.handles.push(h); }
+			void await_resume(void) const noexcept { }
+		};
+		return awaitable { *this };
+	}
+private:
+	void run(void) {
+		for ( ; ; ) {
+			try {
+				handles.pop().resume();
+			}
+			catch (ThreadSafeQueueEmpty &e) {
+				nbThreads.notifyThreadFinalization();
+				return ;
+			}
+		}
+	}
+	LockFreeBoundedQueue<std::coroutine_handle<>> handles;
+	attachedThreads nbThreads;
+};
+
+template <typename T>
+class lazyTask;
+
+template <typename T>
+class lazyTaskPromise;
+
+template <typename T>
+class lazyTaskPromiseBase {
+public:
+	std::suspend_always initial_suspend(void) const noexcept { return { }; }
+	class finalAwaitable {
+	public:
+		bool await_ready(void) const noexcept { return false; }
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<lazyTaskPromise<T>> h) const noexcept {
+			const std::coroutine_handle<> continuation = h.promise().continuation;
+			return continuation ? continuation : std::noop_coroutine();
+		}
+		void await_resume(void) const noexcept { }
+	};
+	finalAwaitable final_suspend(void) const noexcept { return { }; }
+	void unhandled_exception(void) noexcept { error = std::current_exception(); }
+	void setContinuation(std::coroutine_handle<> c) noexcept { continuation = c; }
+protected:
+	void rethrow(void) const {
+		if (nullptr != error)
+			std::rethrow_exception(error);
+	}
+private:
+	std::coroutine_handle<> continuation;
+	std::exception_ptr error;
+};
+
+template <typename T>
+class lazyTaskPromise : public lazyTaskPromiseBase<T> {
+public:
+	lazyTask<T> get_return_object(void) noexcept;
+	template <typename U>
+	void return_value(U &&v) { value.emplace(std::forward<U>(v)); }
+	T result(void) {
+		this->rethrow();
+		return std::move(*value);
+	}
+private:
+	std::optional<T> value;
+};
+
+template <>
+class lazyTaskPromise<void> : public lazyTaskPromiseBase<void> {
+public:
+	lazyTask<void> get_return_object(void) noexcept;
+	void return_void(void) const noexcept { }
+	void result(void) const { rethrow(); }
+};
+
+/* Coroutine that only starts when it is awaited. The awaiting coroutine is resumed by
+ * symmetric transfer when the task completes, in the thread that completed it. */
+template <typename T = void>
+class lazyTask {
+public:
+	using promise_type = lazyTaskPromise<T>;
+
+	lazyTask(lazyTask &&other) noexcept : handle(other.handle) { other.handle = nullptr; }
+	lazyTask &operator=(lazyTask &&other) noexcept {
+		std::swap(handle, other.handle);
+		return *this;
+	}
+	~lazyTask(void) {
+		if (handle)
+			handle.destroy();
+	}
+	auto operator co_await(void) && noexcept {
+		struct awaitable {
+			std::coroutine_handle<promise_type> handle;
+			bool await_ready(void) const noexcept { return handle.done(); }
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) const noexcept {
+				handle.promise().setContinuation(awaiting);
+				return handle;
+			}
+			T await_resume(void) const { return handle.promise().result(); }
+		};
+		return awaitable { handle };
+	}
+private:
+	explicit lazyTask(std::coroutine_handle<promise_type> handle) : handle(handle) { }
+	friend promise_type;
+
+	std::coroutine_handle<promise_type> handle;
+};
+
+template <typename T>
+lazyTask<T> lazyTaskPromise<T>::get_return_object(void) noexcept { return lazyTask<T>(std::coroutine_handle<lazyTaskPromise<T>>::from_promise(*this)); }
+inline lazyTask<void> lazyTaskPromise<void>::get_return_object(void) noexcept { return lazyTask<void>(std::coroutine_handle<lazyTaskPromise<void>>::from_promise(*this)); }
+
+/* Coroutine started explicitly and destroyed by its owner; it never reaches its final
+ * suspension point unless its body completes. Used to drive tasks from outside. */
+class drivingCoroutine {
+public:
+	class promise_type {
+	public:
+		drivingCoroutine get_return_object(void) noexcept { return drivingCoroutine(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		std::suspend_always initial_suspend(void) const noexcept { return { }; }
+		std::suspend_always final_suspend(void) const noexcept { return { }; }
+		void return_void(void) const noexcept { }
+		void unhandled_exception(void) const noexcept { std::terminate(); }
+	};
+
+	drivingCoroutine(drivingCoroutine &&other) noexcept : handle(other.handle) { other.handle = nullptr; }
+	~drivingCoroutine(void) {
+		if (handle)
+			handle.destroy();
+	}
+	void start(void) const { handle.resume(); }
+private:
+	explicit drivingCoroutine(std::coroutine_handle<promise_type> handle) : handle(handle) { }
+
+	std::coroutine_handle<promise_type> handle;
+};
+
+/* Counts the tasks of whenAll still running; the last one to arrive resumes the
+ * coroutine waiting on the whole group. */
+class whenAllLatch {
+public:
+	explicit whenAllLatch(size_t count) : remaining(count + 1) { }
+	void fail(std::exception_ptr e) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (nullptr == error)
+			error = e;
+	}
+	void rethrow(void) const {
+		if (nullptr != error)
+			std::rethrow_exception(error);
+	}
+	auto arrive(void) noexcept {
+		struct awaitable {
+			whenAllLatch &latch;
+			bool await_ready(void) const noexcept { return false; }
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<>) const noexcept {
+				if (1 == latch.remaining.fetch_sub(1, std::memory_order_acq_rel))
+					return latch.continuation;
+				return std::noop_coroutine();
+			}
+			void await_resume(void) const noexcept { }
+		};
+		return awaitable { *this };
+	}
+	auto start(std::vector<drivingCoroutine> &children) noexcept {
+		struct awaitable {
+			whenAllLatch &latch;
+			std::vector<drivingCoroutine> &children;
+			bool await_ready(void) const noexcept { return false; }
+			bool await_suspend(std::coroutine_handle<> awaiting) const noexcept {
+				latch.continuation = awaiting;
+				for (auto &child : children)
+					child.start();
+				return 1 != latch.remaining.fetch_sub(1, std::memory_order_acq_rel);
+			}
+			void await_resume(void) const noexcept { }
+		};
+		return awaitable { *this, children };
+	}
+private:
+	std::atomic<size_t> remaining;
+	std::coroutine_handle<> continuation;
+	std::mutex mutex;
+	std::exception_ptr error;
+};
+
+template <typename T>
+drivingCoroutine runForWhenAll(lazyTask<T> t, std::optional<T> &result, whenAllLatch &latch) {
+	try {
+		result.emplace(co_await std::move(t));
+	}
+	catch (...) {
+		latch.fail(std::current_exception());
+	}
+	co_await latch.arrive();
+}
+
+inline drivingCoroutine runForWhenAll(lazyTask<void> t, whenAllLatch &latch) {
+	try {
+		co_await std::move(t);
+	}
+	catch (...) {
+		latch.fail(std::current_exception());
+	}
+	co_await latch.arrive();
+}
+
+/* Starts all the tasks at once and completes when all of them did. Tasks run
+ * concurrently as far as they co_await a scheduler. The first exception is rethrown. */
+template <typename T>
+lazyTask<std::vector<T>> whenAll(std::vector<lazyTask<T>> tasks) {
+	std::vector<std::optional<T>> results(tasks.size());
+	whenAllLatch latch(tasks.size());
+	std::vector<drivingCoroutine> children;
+	children.reserve(tasks.size());
+	for (size_t i = 0; i < tasks.size(); i++)
+		children.push_back(runForWhenAll(std::move(tasks[i]), results[i], latch));
+	co_await latch.start(children);
+	latch.rethrow();
+	std::vector<T> values;
+	values.reserve(results.size());
+	for (auto &r : results)
+		values.push_back(std::move(*r));
+	co_return values;
+}
+
+inline lazyTask<void> whenAll(std::vector<lazyTask<void>> tasks) {
+	whenAllLatch latch(tasks.size());
+	std::vector<drivingCoroutine> children;
+	children.reserve(tasks.size());
+	for (auto &t : tasks)
+		children.push_back(runForWhenAll(std::move(t), latch));
+	co_await latch.start(children);
+	latch.rethrow();
+}
+
+/* Signals a thread blocked in syncWait. The notification is done under the lock, so
+ * the waiter cannot destroy the coroutine before it left the notifying code. */
+class syncWaitEvent {
+public:
+	void set(void) {
+		std::lock_guard<std::mutex> lock(mutex);
+		done = true;
+		finished.notify_all();
+	}
+	void wait(void) {
+		std::unique_lock<std::mutex> lock(mutex);
+		finished.wait(lock, [this]() { return done; });
+	}
+	auto signal(void) noexcept {
+		struct awaitable {
+			syncWaitEvent &event;
+			bool await_ready(void) const noexcept { return false; }
+			void await_suspend(std::coroutine_handle<>) const { event.set(); }
+			void await_resume(void) const noexcept { }
+		};
+		return awaitable { *this };
+	}
+	std::exception_ptr error;
+private:
+	std::mutex mutex;
+	std::condition_variable finished;
+	bool done = false;
+};
+
+template <typename T>
+drivingCoroutine runForSyncWait(lazyTask<T> t, std::optional<T> &result, syncWaitEvent &event) {
+	try {
+		result.emplace(co_await std::move(t));
+	}
+	catch (...) {
+		event.error = std::current_exception();
+	}
+	co_await event.signal();
+}
+
+inline drivingCoroutine runForSyncWait(lazyTask<void> t, syncWaitEvent &event) {
+	try {
+		co_await std::move(t);
+	}
+	catch (...) {
+		event.error = std::current_exception();
+	}
+	co_await event.signal();
+}
+
+/* Runs a task from code that is not a coroutine and blocks until it completes. */
+template <typename T>
+T syncWait(lazyTask<T> t) {
+	std::optional<T> result;
+	syncWaitEvent event;
+	drivingCoroutine driver = runForSyncWait(std::move(t), result, event);
+	driver.start();
+	event.wait();
+	if (nullptr != event.error)
+		std::rethrow_exception(event.error);
+	return std::move(*result);
+}
+
+inline void syncWait(lazyTask<void> t) {
+	syncWaitEvent event;
+	drivingCoroutine driver = runForSyncWait(std::move(t), event);
+	driver.start();
+	event.wait();
+	if (nullptr != event.error)
+		std::rethrow_exception(event.error);
+}
+
+}
+
+#endif
+
+#endif
@@ -0,0 +1,323 @@
+/* Copyright 2016 Laurent Van Begin
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE OpenSSL PROJECT ``AS IS'' AND ANY
+ * EXPRESSED OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE OpenSSL PROJECT OR
+ * ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+  */
+
+#ifndef EXECUTOR_H__
+#define EXECUTOR_H__
+
+#include <threadpool.h>
+#include <tuple>
+#include <utility>
+#include <exception>
+#include <cstddef>
+#include <new>
+#include <vector>
+
+namespace threadpool {
+
+/* Move-only type-erased callable. Callables up to inlineSize bytes are stored in the
+ * task itself; only larger ones are allocated on the heap. */
+class task {
+public:
+	static const size_t inlineSize = 48;
+
+	task(void) noexcept : operations(nullptr) { }
+	template <typename F, typename = std::enable_if_t<!std::is_same<std::decay_t<F>, task>::value>>
+	task(F &&f) : operations(&operationsFor<std::decay_t<F>>()) {
+		construct<std::decay_t<F>>(std::forward<F>(f), isInline<std::decay_t<F>>());
+	}
+	task(task &&other) noexcept : operations(other.operations) {
+		if (nullptr != operations)
+			operations->move(other.buffer, buffer);
+		other.operations = nullptr;
+	}
+	task &operator=(task &&other) noexcept {
+		if (this != &other) {
+			reset();
+			operations = other.operations;
+			if (nullptr != operations)
+				operations->move(other.buffer, buffer);
+			other.operations = nullptr;
+		}
+		return *this;
+	}
+	~task(void) { reset(); }
+	void operator()(void) { operations->invoke(buffer); }
+	explicit operator bool(void) const { return nullptr != operations; }
+private:
+	struct operationTable {
+		void (*invoke)(void *);
+		void (*move)(void *from, void *to);
+		void (*destroy)(void *);
+	};
+	template <typename F>
+	using isInline = std::integral_constant<bool, sizeof(F) <= inlineSize && alignof(F) <= alignof(std::max_align_t) &&
+							std::is_nothrow_move_constructible<F>::value>;
+
+	template <typename F, typename G>
+	void construct(G &&f, std::true_type) { new (buffer) F(std::forward<G>(f)); }
+	template <typename F, typename G>
+	void construct(G &&f, std::false_type) { *reinterpret_cast<F **>(buffer) = new F(std::forward<G>(f)); }
+	template <typename F>
+	static const operationTable &operationsFor(void) { return operationsFor<F>(isInline<F>()); }
+	template <typename F>
+	static const operationTable &operationsFor(std::true_type) {
+		static const operationTable table {
+			[](void *f) { (*reinterpret_cast<F *>(f))(); },
+			[](void *from, void *to) { new (to) F(std::move(*reinterpret_cast<F *>(from))); reinterpret_cast<F *>(from)->~F(); },
+			[](void *f) { reinterpret_cast<F *>(f)->~F(); },
+		};
+		return table;
+	}
+	template <typename F>
+	static const operationTable &operationsFor(std::false_type) {
+		static const operationTable table {
+			[](void *f) { (**reinterpret_cast<F **>(f))(); },
+			[](void *from, void *to) { *reinterpret_cast<F **>(to) = *reinterpret_cast<F **>(from); },
+			[](void *f) { delete *reinterpret_cast<F **>(f); },
+		};
+		return table;
+	}
+	void reset(void) {
+		if (nullptr != operations)
+			operations->destroy(buffer);
+		operations = nullptr;
+	}
+	alignas(std::max_align_t) unsigned char buffer[inlineSize];
+	const operationTable *operations;
+};
+
+template <typename R>
+class future;
+
+/* Memory of the future states of one Executor. A state goes back to the pool of the
+ * executor it was submitted to, whichever thread releases it last. Free blocks are kept
+ * in a lock-free ring sized for every state the executor can have in flight. The pool
+ * outlives its executor until the last state is released. */
+class futureStatePool {
+public:
+	static const size_t blockSize = 256;
+
+	explicit futureStatePool(size_t maxBlocks) : blocks(maxBlocks), references(1) { }
+	futureStatePool(const futureStatePool &) = delete;
+	futureStatePool &operator=(const futureStatePool &) = delete;
+	/* new ignores the alignment of the ring before C++17. */
+	static void *operator new(size_t size) {
+		void *memory = nullptr;
+
+		if (0 != posix_memalign(&memory, alignof(futureStatePool), size))
+			throw std::bad_alloc();
+		return memory;
+	}
+	static void operator delete(void *memory) { free(memory); }
+	~futureStatePool(void) {
+		messageSlot<void *> slot;
+		while (blocks.tryPop(slot))
+			::operator delete(slot.take());
+	}
+
+	/* Blocks are only recycled for states that fit in blockSize. */
+	void *allocate(bool recycled) {
+		messageSlot<void *> slot;
+
+		references.fetch_add(1, std::memory_order_relaxed);
+		return (recycled && blocks.tryPop(slot)) ? slot.take() : nullptr;
+	}
+	void deallocate(void *memory, bool recycled) {
+		if (nullptr != memory && (!recycled || !blocks.tryPush(memory)))
+			::operator delete(memory);
+		release();
+	}
+	/* Called when the executor goes away. */
+	void orphan(void) { release(); }
+private:
+	void release(void) {
+		if (1 == references.fetch_sub(1, std::memory_order_acq_rel))
+			delete this;
+	}
+
+	LockFreeBoundedQueue<void *> blocks;
+	std::atomic<size_t> references;
+};
+
+/* State shared by a future and the task computing its value. States are recycled
+ * through the pool of their executor instead of being allocated for every task. */
+template <typename R>
+class futureState {
+public:
+	static futureState *acquire(futureStatePool &pool) {
+		void *memory = pool.allocate(recycled());
+
+		if (nullptr == memory) {
+			try {
+				memory = ::operator new(recycled() ? futureStatePool::blockSize : sizeof(futureState));
+			}
+			catch (...) {
+				pool.deallocate(nullptr, false);
+				throw;
+			}
+		}
+		return new (memory) futureState(pool);
+	}
+	void release(void) {
+		if (1 != references.fetch_sub(1, std::memory_order_acq_rel))
+			return ;
+		futureStatePool &pool = home;
+		this->~futureState();
+		pool.deallocate(this, recycled());
+	}
+	template <typename F>
+	void fulfill(F &f) {
+		try {
+			value.set(f);
+		}
+		catch (...) {
+			error = std::current_exception();
+		}
+		/* The mutex is only taken when a thread is blocked in wait(). */
+		ready.store(true);
+		if (!waiting.load())
+			return ;
+		std::lock_guard<std::mutex> lock(mutex);
+		valueSet.notify_all();
+	}
+	void wait(void) {
+		if (ready.load(std::memory_order_acquire))
+			return ;
+		std::unique_lock<std::mutex> lock(mutex);
+		waiting.store(true);
+		valueSet.wait(lock, [this]() { return ready.load(); });
+	}
+	bool isReady(void) const { return ready.load(std::memory_order_acquire); }
+	R get(void) {
+		wait();
+		if (nullptr != error)
+			std::rethrow_exception(error);
+		return value.take();
+	}
+private:
+	template <typename T, typename = void>
+	struct holder {
+		messageSlot<T> slot;
+		template <typename F>
+		void set(F &f) { slot.fill(f()); }
+		T take(void) { return slot.take(); }
+		void reset(void) {
+			if (!slot.isEmpty())
+				slot.take();
+		}
+	};
+	template <typename T>
+	struct holder<T, std::enable_if_t<std::is_void<T>::value>> {
+		template <typename F>
+		void set(F &f) { f(); }
+		void take(void) { }
+		void reset(void) { }
+	};
+	static bool recycled(void) { return sizeof(futureState) <= futureStatePool::blockSize && alignof(futureState) <= alignof(std::max_align_t); }
+
+	explicit futureState(futureStatePool &home) : home(home), references(2), ready(false), waiting(false) { }
+
+	futureStatePool &home;
+	std::atomic<unsigned int> references;
+	std::atomic<bool> ready;
+	std::atomic<bool> waiting;
+	holder<R> value;
+	std::exception_ptr error;
+	std::mutex mutex;
+	std::condition_variable valueSet;
+};
+
+template <typename R>
+class future {
+public:
+	future(void) : state(nullptr) { }
+	explicit future(futureState<R> *state) : state(state) { }
+	future(future &&other) noexcept : state(other.state) { other.state = nullptr; }
+	future &operator=(future &&other) noexcept {
+		std::swap(state, other.state);
+		return *this;
+	}
+	~future(void) {
+		if (nullptr != state)
+			state->release();
+	}
+	bool valid(void) const { return nullptr != state; }
+	bool isReady(void) const { return state->isReady(); }
+	void wait(void) const { state->wait(); }
+	R get(void) {
+		futureState<R> *s = state;
+		state = nullptr;
+		struct releaser { futureState<R> *s; ~releaser() { s->release(); } } release { s };
+		return s->get();
+	}
+private:
+	futureState<R> *state;
+};
+
+/* General purpose executor running arbitrary callables on threads of a cache. */
+class Executor {
+public:
+	explicit Executor(unsigned int poolSize, size_t waitingQueueSize, ThreadCache &threadCache) :
+					states(new futureStatePool(waitingQueueSize + poolSize)), pool(doNothing, [](task t) { t(); }, doNothing, poolSize, waitingQueueSize, threadCache) { }
+	~Executor(void) = default;
+
+	template <typename F, typename... Args>
+	future<std::result_of_t<std::decay_t<F>(std::decay_t<Args>...)>> submit(F &&f, Args&&... args) {
+		using R = std::result_of_t<std::decay_t<F>(std::decay_t<Args>...)>;
+		futureState<R> *state = futureState<R>::acquire(*states);
+
+		pool.add(task([state, call = bind(std::forward<F>(f), std::forward<Args>(args)...)]() mutable {
+			state->fulfill(call);
+			state->release();
+		}));
+		return future<R>(state);
+	}
+	void post(task t) { pool.add(std::move(t)); }
+private:
+	template <typename F, typename... Args>
+	static auto bind(F &&f, Args&&... args) {
+		return [f = std::forward<F>(f), arguments = std::make_tuple(std::forward<Args>(args)...)]() mutable {
+			return apply(f, arguments, std::index_sequence_for<Args...>());
+		};
+	}
+	template <typename F, typename Tuple, size_t... I>
+	static decltype(auto) apply(F &f, Tuple &arguments, std::index_sequence<I...>) { return f(std::move(std::get<I>(arguments))...); }
+
+	struct orphanStates {
+		void operator()(futureStatePool *p) const { p->orphan(); }
+	};
+
+	/* Declared first: the pool is orphaned once the workers released their states. */
+	std::unique_ptr<futureStatePool, orphanStates> states;
+	Threadpool<task, LockFreeBoundedQueue> pool;
+};
+
+}
+
+#endif
@@ -32,21 +32,286 @@
 
 #include <threadpool.h>
 #include <algorithm>
+#include <atomic>
+#include <vector>
+#include <deque>
+#include <exception>
 
 using namespace threadpool;
 
+/* How the index space of a parallel loop is split among the workers:
+ * STATIC gives every worker one contiguous block up front, DYNAMIC hands out chunks
+ * of grainSize indexes on demand and GUIDED hands out chunks proportional to the
+ * remaining work, never smaller than grainSize. */
+enum class schedule { STATIC, DYNAMIC, GUIDED, };
+
+/* Runs f(worker) once for every worker index in [0, nbWorkers) on threads of the cache. */
+template <typename F>
+void runOnWorkers(unsigned int nbWorkers, F f, ThreadCache &cache) {
+	Threadpool<unsigned int> pool(doNothing, [&f](unsigned int worker) { f(worker); }, doNothing, nbWorkers, nbWorkers, cache);
+	for (unsigned int worker = 0; worker < nbWorkers; worker++)
+		pool.add(worker);
+}
+
+/* Hands out disjoint chunks covering [0, size) to nbWorkers workers. Chunks are claimed
+ * through one shared counter instead of one message per index. A grainSize of 0 picks
+ * a grain giving about 8 chunks per worker. */
+class chunkScheduler {
+public:
+	chunkScheduler(size_t size, unsigned int nbWorkers, schedule policy, size_t grainSize) : size(size), nbWorkers(nbWorkers), policy(policy),
+					grain((0 == grainSize) ? std::max<size_t>(1, size / (8 * nbWorkers)) : grainSize), next(0) { }
+	template <typename F>
+	void run(unsigned int worker, F &f) {
+		if (schedule::STATIC == policy) {
+			f(size * worker / nbWorkers, size * (worker + 1) / nbWorkers);
+			return ;
+		}
+		size_t begin, end;
+		while (claim(begin, end))
+			f(begin, end);
+	}
+private:
+	bool claim(size_t &begin, size_t &end) {
+		begin = next.load(std::memory_order_relaxed);
+		do {
+			if (begin >= size)
+				return false;
+			const size_t chunk = (schedule::GUIDED == policy) ? std::max(grain, (size - begin) / (2 * nbWorkers)) : grain;
+			end = std::min(size, begin + chunk);
+		} while (!next.compare_exchange_weak(begin, end, std::memory_order_relaxed));
+		return true;
+	}
+	const size_t size;
+	const unsigned int nbWorkers;
+	const schedule policy;
+	const size_t grain;
+	std::atomic<size_t> next;
+};
+
+/* Threads of a cache kept attached to one pool across parallel loops. The loops of map.h
+ * and reduce.h run on a team as they run on a cache, but a team waits for its pool to be
+ * idle between loops instead of building and destroying a pool, so that short parallel
+ * phases do not pay for leasing threads every time. A team must not be used from one of
+ * its own workers. */
+class WorkerTeam {
+public:
+	explicit WorkerTeam(unsigned int nbWorkers, ThreadCache &cache) : nbWorkers(nbWorkers),
+						pool(doNothing, [](teamTask t) { t.call(t.f, t.worker); }, doNothing, nbWorkers, nbWorkers, cache) { }
+	unsigned int getSize(void) const { return nbWorkers; }
+	/* Runs f(worker) for every worker index in [0, nbTasks) and waits for all of them. */
+	template <typename F>
+	void run(unsigned int nbTasks, F &f) {
+		for (unsigned int worker = 0; worker < nbTasks; worker++)
+			pool.add(teamTask { &invoke<F>, &f, worker });
+		pool.wait();
+	}
+private:
+	struct teamTask {
+		void (*call)(void *, unsigned int);
+		void *f;
+		unsigned int worker;
+	};
+	template <typename F>
+	static void invoke(void *f, unsigned int worker) { (*static_cast<F *>(f))(worker); }
+
+	const unsigned int nbWorkers;
+	Threadpool<teamTask, LockFreeBoundedQueue, true> pool;
+};
+
+template <typename F>
+void runOnWorkers(unsigned int nbWorkers, F f, WorkerTeam &team) { team.run(nbWorkers, f); }
+
+template <typename Workers>
+unsigned int workersFor(size_t size, Workers &workers) {
+	return static_cast<unsigned int>(std::min<size_t>(workers.getSize(), size));
+}
+
+/* Calls f(begin, end) on disjoint chunks covering [0, size), using every thread of the
+ * cache or of the team. */
+template <typename F, typename Workers>
+void forEachChunk(size_t size, F f, Workers &workers, schedule policy = schedule::STATIC, size_t grainSize = 0) {
+	if (0 == size)
+		return ;
+	const unsigned int nbWorkers = workersFor(size, workers);
+	chunkScheduler chunks(size, nbWorkers, policy, grainSize);
+	runOnWorkers(nbWorkers, [&chunks, &f](unsigned int worker) { chunks.run(worker, f); }, workers);
+}
+
+template<typename Iterator, typename F, typename Workers>
+void forEach(Iterator first, Iterator last, F f, Workers &workers, schedule policy = schedule::STATIC, size_t grainSize = 0) {
+	forEachChunk(static_cast<size_t>(last - first), [first, &f](size_t begin, size_t end) {
+		for (auto it = first + begin; it != first + end; ++it)
+			f(*it);
+	}, workers, policy, grainSize);
+}
+
+template<typename InputIterator, typename OutputIterator, typename F, typename Workers>
+void map(InputIterator first, InputIterator last, OutputIterator output, F f, Workers &workers, schedule policy = schedule::STATIC, size_t grainSize = 0) {
+	forEachChunk(static_cast<size_t>(last - first), [first, output, &f](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+			output[i] = f(first[i]);
+	}, workers, policy, grainSize);
+}
+
 template<typename M>
 void map(std::vector<M> &v, std::function<void(M *)> f, ThreadCache &cache) {
-	Threadpool<M *> pool(doNothing, f, doNothing, 10, 10, cache);
-	std::for_each(v.begin(), v.end(), [&pool](M &e) { pool.add(&e); });
+	forEach(v.begin(), v.end(), [&f](M &e) { f(&e); }, cache, schedule::DYNAMIC);
 }
 
 template<typename M, typename O>
 std::vector<O> map(const std::vector<M> &v, std::function<M(const M *)> f, ThreadCache &cache) {
 	std::vector<O> output(v.size());
-	Threadpool<unsigned int> pool(doNothing, [&output, &v, f](unsigned int i) { output[i] = std::move(f(&v[i])); }, doNothing, 10, 10, cache);
-	for (unsigned int i = 0; i < v.size(); i++) { pool.add(i); };
+	forEachChunk(v.size(), [&output, &v, &f](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+			output[i] = std::move(f(&v[i]));
+	}, cache, schedule::DYNAMIC);
 	return output;
 }
 
+/* ORDERED hands the results of a streaming map to the sink in input order; UNORDERED
+ * hands them over as soon as they are computed. */
+enum class streamOrder { ORDERED, UNORDERED, };
+
+/* Results of the items in flight in a streaming map. In ORDERED mode the result of item i
+ * waits in slot i % size until all the previous ones were delivered. Results are handed
+ * to the sink by the thread calling deliver, outside the lock. After a failure, the
+ * remaining results are dropped. */
+template <typename O>
+class reorderWindow {
+public:
+	reorderWindow(size_t size, streamOrder order) : size(size), order(order), slots((streamOrder::ORDERED == order) ? size : 0),
+					delivered(0), skipped(0) { }
+	void complete(size_t sequence, O value) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (streamOrder::ORDERED == order) {
+			slots[sequence % size].value.fill(std::move(value));
+			slots[sequence % size].ready = true;
+		}
+		else
+			completed.push_back(std::move(value));
+		resultAvailable.notify_one();
+	}
+	void fail(size_t sequence, std::exception_ptr e) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (nullptr == error)
+			error = e;
+		if (streamOrder::ORDERED == order)
+			slots[sequence % size].ready = true;
+		else
+			skipped++;
+		resultAvailable.notify_one();
+	}
+	bool failed(void) {
+		std::lock_guard<std::mutex> lock(mutex);
+		return nullptr != error;
+	}
+	void rethrow(void) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (nullptr != error)
+			std::rethrow_exception(error);
+	}
+	/* Delivers every available result, waiting for more until target results were delivered. */
+	template <typename Sink>
+	void deliver(size_t target, Sink &sink) {
+		std::unique_lock<std::mutex> lock(mutex);
+		for ( ; ; ) {
+			messageSlot<O> value;
+			if (!takeNext(value)) {
+				if (delivered >= target)
+					return ;
+				resultAvailable.wait(lock);
+				continue;
+			}
+			delivered++;
+			if (value.isEmpty() || nullptr != error)
+				continue;
+			lock.unlock();
+			sink(value.take());
+			lock.lock();
+		}
+	}
+private:
+	struct slot {
+		slot(void) : ready(false) { }
+		messageSlot<O> value;
+		bool ready;
+	};
+	bool takeNext(messageSlot<O> &value) {
+		if (streamOrder::ORDERED == order) {
+			slot &next = slots[delivered % size];
+			if (!next.ready)
+				return false;
+			next.ready = false;
+			if (!next.value.isEmpty())
+				value.fill(next.value.take());
+			return true;
+		}
+		if (!completed.empty()) {
+			value.fill(std::move(completed.front()));
+			completed.pop_front();
+			return true;
+		}
+		if (0 == skipped)
+			return false;
+		skipped--;
+		return true;
+	}
+	const size_t size;
+	const streamOrder order;
+	std::vector<slot> slots;
+	std::deque<O> completed;
+	size_t delivered;
+	size_t skipped;
+	std::mutex mutex;
+	std::condition_variable resultAvailable;
+	std::exception_ptr error;
+};
+
+/* Applies f to every item produced by next (a bool(I &) callable returning false at the end
+ * of the stream) on threads of the cache and hands the results to sink on the calling
+ * thread. At most window items are in flight, whatever the length of the stream; like the
+ * waitingQueueSize of a Threadpool, the window bounds the memory used. The first exception
+ * thrown by f stops the stream and is rethrown. */
+template<typename I, typename Generator, typename F, typename Sink>
+void streamingMap(Generator next, F f, Sink sink, size_t window, ThreadCache &cache, streamOrder order = streamOrder::ORDERED) {
+	typedef std::decay_t<std::result_of_t<F &(I &)>> O;
+	struct streamItem {
+		size_t sequence;
+		I item;
+	};
+	window = std::max<size_t>(1, window);
+	reorderWindow<O> results(window, order);
+	{
+		const unsigned int nbWorkers = workersFor(window, cache);
+		Threadpool<streamItem> pool(doNothing, [&f, &results](streamItem m) {
+			try {
+				results.complete(m.sequence, f(m.item));
+			}
+			catch (...) {
+				results.fail(m.sequence, std::current_exception());
+			}
+		}, doNothing, nbWorkers, window, cache);
+		size_t dispatched = 0;
+		I item;
+		while (!results.failed() && next(item)) {
+			results.deliver((dispatched < window) ? 0 : dispatched + 1 - window, sink);
+			pool.add(streamItem { dispatched++, std::move(item) });
+		}
+		results.deliver(dispatched, sink);
+	}
+	results.rethrow();
+}
+
+template<typename InputIterator, typename F, typename Sink>
+void streamingMap(InputIterator first, InputIterator last, F f, Sink sink, size_t window, ThreadCache &cache, streamOrder order = streamOrder::ORDERED) {
+	typedef std::decay_t<decltype(*first)> I;
+	streamingMap<I>([&first, &last](I &item) {
+		if (first == last)
+			return false;
+		item = *first;
+		++first;
+		return true;
+	}, std::move(f), std::move(sink), window, cache, order);
+}
+
 #endif
@@ -0,0 +1,343 @@
+/* Copyright 2016 Laurent Van Begin
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE OpenSSL PROJECT ``AS IS'' AND ANY
+ * EXPRESSED OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE OpenSSL PROJECT OR
+ * ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+  */
+
+#ifndef METRICS_H__
+#define METRICS_H__
+
+#include <queue.h>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <iterator>
+
+/* Instrumentation of pools and caches is compiled in only when THREADPOOL_METRICS is
+ * defined; otherwise every hook is an empty inline function and snapshots are empty. */
+
+namespace threadpool {
+
+#ifdef THREADPOOL_METRICS
+static const bool metricsEnabled = true;
+#else
+static const bool metricsEnabled = false;
+#endif
+
+typedef std::chrono::steady_clock metricsClock;
+
+static inline uint64_t nanosecondsBetween(metricsClock::time_point from, metricsClock::time_point to) {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(to - from).count();
+}
+
+struct latencySummary {
+	uint64_t count = 0;
+	uint64_t totalNs = 0;
+	uint64_t maxNs = 0;
+	uint64_t p50Ns = 0;
+	uint64_t p99Ns = 0;
+};
+
+struct workerSnapshot {
+	uint64_t messages;
+	uint64_t busyNs;
+};
+
+struct poolSnapshot {
+	uint64_t added = 0;
+	uint64_t processed = 0;
+	uint64_t queueDepth = 0;
+	latencySummary addBlocked;
+	latencySummary queueWait;
+	latencySummary service;
+	std::vector<workerSnapshot> workers;
+};
+
+struct cachedThreadSnapshot {
+	uint64_t leases;
+	uint64_t busyNs;
+	uint64_t idleNs;
+};
+
+struct cacheSnapshot {
+	unsigned int liveThreads = 0;
+	unsigned int idleThreads = 0;
+	uint64_t spawned = 0;
+	uint64_t retired = 0;
+	std::vector<cachedThreadSnapshot> threads;
+};
+
+/* Latencies counted in power-of-two buckets of nanoseconds; merged on read. */
+class latencyHistogram {
+public:
+	static const unsigned int nbBuckets = 64;
+
+	latencyHistogram(void) : total(0), max(0) {
+		for (auto &bucket : buckets)
+			bucket.store(0, std::memory_order_relaxed);
+	}
+	void record(uint64_t ns) {
+		buckets[bucketOf(ns)].fetch_add(1, std::memory_order_relaxed);
+		total.fetch_add(ns, std::memory_order_relaxed);
+		uint64_t currentMax = max.load(std::memory_order_relaxed);
+		while (ns > currentMax && !max.compare_exchange_weak(currentMax, ns, std::memory_order_relaxed))
+			;
+	}
+	/* Accumulates the histogram in counts, which must have nbBuckets entries. */
+	void mergeInto(std::vector<uint64_t> &counts, latencySummary &summary) const {
+		for (unsigned int i = 0; i < nbBuckets; i++) {
+			const uint64_t count = buckets[i].load(std::memory_order_relaxed);
+			counts[i] += count;
+			summary.count += count;
+		}
+		summary.totalNs += total.load(std::memory_order_relaxed);
+		summary.maxNs = std::max(summary.maxNs, max.load(std::memory_order_relaxed));
+	}
+	/* Fills the percentiles of summary with the upper bound of their bucket. */
+	static void percentiles(const std::vector<uint64_t> &counts, latencySummary &summary) {
+		summary.p50Ns = percentile(counts, summary, 0.5);
+		summary.p99Ns = percentile(counts, summary, 0.99);
+	}
+	static unsigned int bucketOf(uint64_t ns) { return 0 == ns ? 0 : 63 - __builtin_clzll(ns); }
+private:
+	static uint64_t percentile(const std::vector<uint64_t> &counts, const latencySummary &summary, double rank) {
+		const uint64_t target = static_cast<uint64_t>(rank * summary.count);
+		uint64_t seen = 0;
+		for (unsigned int i = 0; i < nbBuckets; i++) {
+			seen += counts[i];
+			if (seen > target)
+				return std::min(summary.maxNs, (i < 63) ? (uint64_t(2) << i) - 1 : UINT64_MAX);
+		}
+		return summary.maxNs;
+	}
+	std::atomic<uint64_t> buckets[nbBuckets];
+	std::atomic<uint64_t> total;
+	std::atomic<uint64_t> max;
+};
+
+#ifdef THREADPOOL_METRICS
+
+/* Message stamped with the time it was added, so that its waiting time is known. */
+template <typename M>
+struct stamped {
+	stamped(M message) : message(std::move(message)), added(metricsClock::now()) { }
+	M message;
+	metricsClock::time_point added;
+};
+
+/* Counters of a pool. Every worker writes its own counters, on their own cache lines;
+ * only the counters of add() are shared between producers. */
+class poolMetrics {
+public:
+	template <typename M>
+	using queued = stamped<M>;
+
+	poolMetrics(void) : added(0), traceStart(0), traceEnd(0) { }
+	template <typename M>
+	static M &messageOf(stamped<M> &message) { return message.message; }
+	metricsClock::time_point addStarted(void) const { return metricsClock::now(); }
+	void addEnded(metricsClock::time_point start, uint64_t nbMessages = 1) {
+		addBlocked.record(nanosecondsBetween(start, metricsClock::now()));
+		added.fetch_add(nbMessages, std::memory_order_relaxed);
+	}
+	template <typename Iterator>
+	static uint64_t count(Iterator first, Iterator last) { return std::distance(first, last); }
+	/* Called by each worker before its first message. */
+	void attachWorker(void) {
+		std::lock_guard<std::mutex> lock(mutex);
+
+		workers.push_back(std::make_unique<workerCounters>());
+		currentWorker() = workers.back().get();
+	}
+	template <typename M>
+	metricsClock::time_point messageStarted(const stamped<M> &message) {
+		const auto now = metricsClock::now();
+		currentWorker()->queueWait.record(nanosecondsBetween(message.added, now));
+		return now;
+	}
+	void messageEnded(metricsClock::time_point start, uint64_t nbMessages = 1) {
+		const auto now = metricsClock::now();
+		const uint64_t duration = nanosecondsBetween(start, now);
+		workerCounters *self = currentWorker();
+
+		self->service.record(duration);
+		self->messages.store(self->messages.load(std::memory_order_relaxed) + nbMessages, std::memory_order_relaxed);
+		self->busyNs.store(self->busyNs.load(std::memory_order_relaxed) + duration, std::memory_order_relaxed);
+		const int64_t startNs = sinceEpoch(start);
+		if (startNs >= traceStart.load(std::memory_order_relaxed) && startNs < traceEnd.load(std::memory_order_relaxed)) {
+			std::lock_guard<std::mutex> lock(self->traceMutex);
+			self->trace.push_back(traceEvent { startNs, duration, nbMessages });
+		}
+	}
+	poolSnapshot snapshot(void) {
+		std::lock_guard<std::mutex> lock(mutex);
+		std::vector<uint64_t> waitCounts(latencyHistogram::nbBuckets), serviceCounts(latencyHistogram::nbBuckets), addCounts(latencyHistogram::nbBuckets);
+		poolSnapshot result;
+
+		result.added = added.load(std::memory_order_relaxed);
+		addBlocked.mergeInto(addCounts, result.addBlocked);
+		for (const auto &w : workers) {
+			const workerSnapshot worker { w->messages.load(std::memory_order_relaxed), w->busyNs.load(std::memory_order_relaxed) };
+			result.processed += worker.messages;
+			result.workers.push_back(worker);
+			w->queueWait.mergeInto(waitCounts, result.queueWait);
+			w->service.mergeInto(serviceCounts, result.service);
+		}
+		result.queueDepth = (result.added > result.processed) ? result.added - result.processed : 0;
+		latencyHistogram::percentiles(addCounts, result.addBlocked);
+		latencyHistogram::percentiles(waitCounts, result.queueWait);
+		latencyHistogram::percentiles(serviceCounts, result.service);
+		return result;
+	}
+	/* Records the messages started during the next window for writeChromeTrace(). */
+	void startTrace(std::chrono::microseconds window) {
+		const int64_t now = sinceEpoch(metricsClock::now());
+		traceEnd.store(0, std::memory_order_relaxed);
+		traceStart.store(now, std::memory_order_relaxed);
+		traceEnd.store(now + std::chrono::duration_cast<std::chrono::nanoseconds>(window).count(), std::memory_order_relaxed);
+	}
+	/* Writes the recorded messages in Chrome trace-event format (chrome://tracing). */
+	void writeChromeTrace(std::ostream &output) {
+		std::lock_guard<std::mutex> lock(mutex);
+		const char *separator = "";
+
+		output << "{\"traceEvents\":[";
+		for (size_t tid = 0; tid < workers.size(); tid++) {
+			std::lock_guard<std::mutex> traceLock(workers[tid]->traceMutex);
+			for (const auto &event : workers[tid]->trace) {
+				output << separator << "{\"name\":\"" << (1 == event.nbMessages ? "message" : "batch") << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << tid
+					<< ",\"ts\":" << event.startNs / 1000.0 << ",\"dur\":" << event.durationNs / 1000.0
+					<< ",\"args\":{\"messages\":" << event.nbMessages << "}}";
+				separator = ",";
+			}
+		}
+		output << "]}" << std::endl;
+	}
+private:
+	struct traceEvent {
+		int64_t startNs;
+		uint64_t durationNs;
+		uint64_t nbMessages;
+	};
+	struct alignas(cacheLineSize) workerCounters {
+		workerCounters(void) : messages(0), busyNs(0) { }
+		/* new ignores alignas(cacheLineSize) before C++17. */
+		static void *operator new(size_t size) {
+			void *memory = nullptr;
+
+			if (0 != posix_memalign(&memory, cacheLineSize, size))
+				throw std::bad_alloc();
+			return memory;
+		}
+		static void operator delete(void *memory) { free(memory); }
+		std::atomic<uint64_t> messages;
+		std::atomic<uint64_t> busyNs;
+		latencyHistogram queueWait;
+		latencyHistogram service;
+		std::mutex traceMutex;
+		std::vector<traceEvent> trace;
+	};
+	static workerCounters *&currentWorker(void) {
+		static thread_local workerCounters *worker = nullptr;
+		return worker;
+	}
+	static int64_t sinceEpoch(metricsClock::time_point t) {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+	}
+
+	std::mutex mutex;
+	std::deque<std::unique_ptr<workerCounters>> workers;
+	alignas(cacheLineSize) std::atomic<uint64_t> added;
+	latencyHistogram addBlocked;
+	std::atomic<int64_t> traceStart;
+	std::atomic<int64_t> traceEnd;
+};
+
+/* Time a cached thread spent running leases and waiting in the cache. */
+class cachedThreadMetrics {
+public:
+	cachedThreadMetrics(void) : leases(0), busyNs(0), idleNs(0), lastChange(metricsClock::now()) { }
+	void leaseStarted(void) {
+		const auto now = metricsClock::now();
+		idleNs.store(idleNs.load(std::memory_order_relaxed) + nanosecondsBetween(lastChange, now), std::memory_order_relaxed);
+		leases.store(leases.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		lastChange = now;
+	}
+	void leaseEnded(void) {
+		const auto now = metricsClock::now();
+		busyNs.store(busyNs.load(std::memory_order_relaxed) + nanosecondsBetween(lastChange, now), std::memory_order_relaxed);
+		lastChange = now;
+	}
+	cachedThreadSnapshot snapshot(void) const {
+		return cachedThreadSnapshot { leases.load(std::memory_order_relaxed), busyNs.load(std::memory_order_relaxed), idleNs.load(std::memory_order_relaxed) };
+	}
+private:
+	std::atomic<uint64_t> leases;
+	std::atomic<uint64_t> busyNs;
+	std::atomic<uint64_t> idleNs;
+	metricsClock::time_point lastChange;
+};
+
+#else
+
+class poolMetrics {
+public:
+	template <typename M>
+	using queued = M;
+
+	template <typename M>
+	static M &messageOf(M &message) { return message; }
+	metricsClock::time_point addStarted(void) const { return metricsClock::time_point(); }
+	void addEnded(metricsClock::time_point, uint64_t = 1) { }
+	template <typename Iterator>
+	static uint64_t count(Iterator, Iterator) { return 0; }
+	void attachWorker(void) { }
+	template <typename M>
+	metricsClock::time_point messageStarted(const M &) { return metricsClock::time_point(); }
+	void messageEnded(metricsClock::time_point, uint64_t = 1) { }
+	poolSnapshot snapshot(void) { return poolSnapshot(); }
+	void startTrace(std::chrono::microseconds) { }
+	void writeChromeTrace(std::ostream &output) { output << "{\"traceEvents\":[]}" << std::endl; }
+};
+
+class cachedThreadMetrics {
+public:
+	void leaseStarted(void) { }
+	void leaseEnded(void) { }
+	cachedThreadSnapshot snapshot(void) const { return cachedThreadSnapshot { 0, 0, 0 }; }
+};
+
+#endif
+
+}
+
+#endif
@@ -0,0 +1,199 @@
+/* Copyright 2016 Laurent Van Begin
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE OpenSSL PROJECT ``AS IS'' AND ANY
+ * EXPRESSED OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE OpenSSL PROJECT OR
+ * ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+  */
+
+#ifndef PIPELINE_H__
+#define PIPELINE_H__
+
+#include <threadpool.h>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <map>
+#include <limits>
+#include <exception>
+
+namespace threadpool {
+
+/* PARALLEL stages process up to their concurrency limit of tokens at a time, in any
+ * order. SERIAL_IN_ORDER stages process one token at a time, in the order the tokens
+ * entered the pipeline. SERIAL_OUT_OF_ORDER stages process one token at a time, in any
+ * order. */
+enum class stageMode { PARALLEL, SERIAL_IN_ORDER, SERIAL_OUT_OF_ORDER, };
+
+/* Chain of stages applied to every token of type T, run by workers leased from a
+ * ThreadCache. At most maxTokens tokens are in flight, which bounds the memory used by
+ * the buffers in front of the stages. A worker carries its token from one stage to the
+ * next as long as the next stage can take it, so adjacent stages do not pay a queue
+ * handoff; a token that has to wait for a stage is parked in the stage buffer and handed
+ * back to the workers by the one that makes room. Every token is in exactly one place,
+ * so a worker queue of maxTokens slots never blocks. */
+template <typename T>
+class Pipeline {
+public:
+	explicit Pipeline(ThreadCache &cache, unsigned int nbWorkers, size_t maxTokens) :
+						cache(cache), nbWorkers(nbWorkers), maxTokens(std::max<size_t>(1, maxTokens)), inFlight(0), workers(nullptr) { }
+	Pipeline &stage(stageMode mode, std::function<void(T &)> f, unsigned int concurrency = std::numeric_limits<unsigned int>::max()) {
+		stages.push_back(std::make_unique<stageState>(mode, std::move(f), (stageMode::PARALLEL == mode) ? std::max(1u, concurrency) : 1));
+		return *this;
+	}
+	/* Feeds every element of [first, last) to the pipeline and waits until all went
+	 * through. The first exception thrown by a stage is rethrown; the token it was
+	 * thrown for skips the following stages. */
+	template <typename Iterator>
+	void run(Iterator first, Iterator last) {
+		unsigned long sequence = 0;
+		error = nullptr;
+		for (auto &s : stages)
+			s->nextSequence = 0;
+		{
+			Threadpool<tokenMessage> pool(doNothing, [this](tokenMessage m) { process(std::move(m)); }, doNothing, nbWorkers, maxTokens, cache);
+			workers = &pool;
+			for ( ; first != last; ++first) {
+				std::unique_lock<std::mutex> lock(mutex);
+				tokenReleased.wait(lock, [this]() { return inFlight < maxTokens; });
+				inFlight++;
+				lock.unlock();
+				pool.add(tokenMessage { std::make_unique<token>(token { sequence++, false, T(*first) }), 0 });
+			}
+			std::unique_lock<std::mutex> lock(mutex);
+			tokenReleased.wait(lock, [this]() { return 0 == inFlight; });
+			workers = nullptr;
+		}
+		if (nullptr != error)
+			std::rethrow_exception(error);
+	}
+private:
+	struct token {
+		unsigned long sequence;
+		bool failed;
+		T value;
+	};
+	struct tokenMessage {
+		std::unique_ptr<token> t;
+		size_t stage;
+	};
+	struct stageState {
+		stageState(stageMode mode, std::function<void(T &)> f, unsigned int concurrency) :
+						mode(mode), f(std::move(f)), concurrency(concurrency), running(0), nextSequence(0) { }
+		bool canStart(const token &t) const {
+			return running < concurrency && (stageMode::SERIAL_IN_ORDER != mode || t.sequence == nextSequence);
+		}
+		/* Next parked token allowed to start, if any. It is handed back to the workers
+		 * without reserving the stage: it parks again if another token was faster. */
+		std::unique_ptr<token> takeReady(void) {
+			std::unique_ptr<token> ready;
+			if (running >= concurrency)
+				return ready;
+			if (stageMode::SERIAL_IN_ORDER == mode) {
+				const auto next = ordered.find(nextSequence);
+				if (ordered.end() != next) {
+					ready = std::move(next->second);
+					ordered.erase(next);
+				}
+			}
+			else if (!parked.empty()) {
+				ready = std::move(parked.front());
+				parked.pop_front();
+			}
+			return ready;
+		}
+		void park(std::unique_ptr<token> t) {
+			if (stageMode::SERIAL_IN_ORDER == mode)
+				ordered.emplace(t->sequence, std::move(t));
+			else
+				parked.push_back(std::move(t));
+		}
+
+		const stageMode mode;
+		const std::function<void(T &)> f;
+		const unsigned int concurrency;
+		unsigned int running;
+		unsigned long nextSequence;
+		std::mutex mutex;
+		std::deque<std::unique_ptr<token>> parked;
+		std::map<unsigned long, std::unique_ptr<token>> ordered;
+	};
+
+	void process(tokenMessage message) {
+		std::unique_ptr<token> t = std::move(message.t);
+
+		for (size_t index = message.stage; index < stages.size(); index++) {
+			stageState &s = *stages[index];
+			std::unique_ptr<token> ready;
+			{
+				std::lock_guard<std::mutex> lock(s.mutex);
+				if (!s.canStart(*t)) {
+					s.park(std::move(t));
+					return ;
+				}
+				s.running++;
+			}
+			if (!t->failed)
+				apply(s, *t);
+			{
+				std::lock_guard<std::mutex> lock(s.mutex);
+				s.running--;
+				if (stageMode::SERIAL_IN_ORDER == s.mode)
+					s.nextSequence++;
+				ready = s.takeReady();
+			}
+			if (nullptr != ready)
+				workers->add(tokenMessage { std::move(ready), index });
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		inFlight--;
+		tokenReleased.notify_all();
+	}
+	void apply(stageState &s, token &t) {
+		try {
+			s.f(t.value);
+		}
+		catch (...) {
+			t.failed = true;
+			std::lock_guard<std::mutex> lock(mutex);
+			if (nullptr == error)
+				error = std::current_exception();
+		}
+	}
+
+	ThreadCache &cache;
+	const unsigned int nbWorkers;
+	const size_t maxTokens;
+	std::vector<std::unique_ptr<stageState>> stages;
+	std::mutex mutex;
+	std::condition_variable tokenReleased;
+	size_t inFlight;
+	std::exception_ptr error;
+	Threadpool<tokenMessage> *workers;
+};
+
+}
+
+#endif
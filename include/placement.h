@@ -0,0 +1,278 @@
+/* Copyright 2016 Laurent Van Begin
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE OpenSSL PROJECT ``AS IS'' AND ANY
+ * EXPRESSED OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE OpenSSL PROJECT OR
+ * ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+  */
+
+#ifndef PLACEMENT_H__
+#define PLACEMENT_H__
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <thread>
+#include <utility>
+#include <tuple>
+#include <exception>
+#include <stdexcept>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace threadpool {
+
+/* CPUs usable by the process, as described by Linux sysfs. The allowed CPUs are those
+ * of the main thread (Cpus_allowed_list of /proc/self/status), i.e. the mask the process
+ * was started with unless the main thread pinned itself since: a pool thread pinned
+ * elsewhere still sees them all. Without sysfs (or on a machine without NUMA support),
+ * every CPU is reported on node 0. */
+class cpuTopology {
+public:
+	struct cpu {
+		unsigned int id;
+		unsigned int package;
+		unsigned int core;
+		unsigned int node;
+	};
+
+	static const cpuTopology &get(void) {
+		static const cpuTopology topology("/sys/devices/system");
+		return topology;
+	}
+	explicit cpuTopology(const std::string &sysfs) {
+		const std::vector<unsigned int> allowed = processCpus("/proc/self/status");
+
+		for (unsigned int id : readList(sysfs + "/cpu/online")) {
+			if (!allowed.empty() && allowed.end() == std::find(allowed.begin(), allowed.end(), id))
+				continue;
+			const std::string topology = sysfs + "/cpu/cpu" + std::to_string(id) + "/topology/";
+			cpus.push_back(cpu { id, readValue(topology + "physical_package_id", 0), readValue(topology + "core_id", id), 0 });
+		}
+		for (unsigned int node : readList(sysfs + "/node/online")) {
+			for (unsigned int id : readList(sysfs + "/node/node" + std::to_string(node) + "/cpulist"))
+				for (auto &c : cpus)
+					if (c.id == id)
+						c.node = node;
+		}
+		if (cpus.empty())
+			for (unsigned int id = 0; id < std::thread::hardware_concurrency(); id++)
+				cpus.push_back(cpu { id, 0, id, 0 });
+	}
+	const std::vector<cpu> &allCpus(void) const { return cpus; }
+	std::vector<unsigned int> nodes(void) const {
+		std::vector<unsigned int> result;
+		for (const auto &c : cpus)
+			result.push_back(c.node);
+		std::sort(result.begin(), result.end());
+		result.erase(std::unique(result.begin(), result.end()), result.end());
+		return result;
+	}
+	std::vector<unsigned int> cpusOfNode(unsigned int node) const {
+		std::vector<unsigned int> result;
+		for (const auto &c : cpus)
+			if (c.node == node)
+				result.push_back(c.id);
+		return result;
+	}
+	/* Parses a sysfs CPU list such as "0-3,8,10-11". */
+	static std::vector<unsigned int> parseList(const std::string &list) {
+		std::vector<unsigned int> result;
+		std::stringstream ranges(list);
+		std::string range;
+
+		while (std::getline(ranges, range, ',')) {
+			unsigned int first, last;
+			char dash;
+			std::stringstream bounds(range);
+			if (!(bounds >> first))
+				continue;
+			if (!(bounds >> dash >> last))
+				last = first;
+			for (unsigned int id = first; id <= last; id++)
+				result.push_back(id);
+		}
+		return result;
+	}
+private:
+	static std::vector<unsigned int> readList(const std::string &path) {
+		std::ifstream file(path);
+		std::string list;
+
+		std::getline(file, list);
+		return parseList(list);
+	}
+	static unsigned int readValue(const std::string &path, unsigned int defaultValue) {
+		std::ifstream file(path);
+		int value;
+
+		return (file >> value && value >= 0) ? static_cast<unsigned int>(value) : defaultValue;
+	}
+	/* Cpus_allowed_list of the main thread; empty (every CPU allowed) when it cannot be read. */
+	static std::vector<unsigned int> processCpus(const std::string &path) {
+		static const std::string key = "Cpus_allowed_list:";
+		std::ifstream file(path);
+		std::string line;
+
+		while (std::getline(file, line))
+			if (0 == line.compare(0, key.size(), key))
+				return parseList(line.substr(key.size()));
+		return std::vector<unsigned int>();
+	}
+	std::vector<cpu> cpus;
+};
+
+/* Where the threads of a cache run. compact() fills a core (hyperthreads included),
+ * then a package, before using the next one; scatter() spreads threads over packages
+ * and cores first; cpus() pins threads round-robin on an explicit list; node() lets
+ * every thread run on any CPU of a NUMA node. */
+class placement {
+public:
+	static placement none(void) { return placement({ }, false); }
+	static placement compact(const cpuTopology &topology = cpuTopology::get()) {
+		auto cpus = topology.allCpus();
+		std::sort(cpus.begin(), cpus.end(), [](const auto &a, const auto &b) {
+			return std::make_tuple(a.node, a.package, a.core, a.id) < std::make_tuple(b.node, b.package, b.core, b.id);
+		});
+		return placement(ids(cpus), false);
+	}
+	static placement scatter(const cpuTopology &topology = cpuTopology::get()) {
+		struct ranked { unsigned int sibling; unsigned int core; unsigned int package; unsigned int id; };
+		const auto &cpus = topology.allCpus();
+		std::vector<ranked> order;
+
+		for (const auto &c : cpus) {
+			unsigned int sibling = 0;
+			std::vector<unsigned int> cores;
+			for (const auto &other : cpus) {
+				if (other.package != c.package)
+					continue;
+				if (other.core == c.core && other.id < c.id)
+					sibling++;
+				cores.push_back(other.core);
+			}
+			std::sort(cores.begin(), cores.end());
+			cores.erase(std::unique(cores.begin(), cores.end()), cores.end());
+			const unsigned int core = std::lower_bound(cores.begin(), cores.end(), c.core) - cores.begin();
+			order.push_back(ranked { sibling, core, c.package, c.id });
+		}
+		std::sort(order.begin(), order.end(), [](const auto &a, const auto &b) {
+			return std::make_tuple(a.sibling, a.core, a.package, a.id) < std::make_tuple(b.sibling, b.core, b.package, b.id);
+		});
+		std::vector<unsigned int> result;
+		for (const auto &r : order)
+			result.push_back(r.id);
+		return placement(std::move(result), false);
+	}
+	static placement cpus(std::vector<unsigned int> cpuList) { return placement(std::move(cpuList), false); }
+	static placement node(unsigned int node, const cpuTopology &topology = cpuTopology::get()) {
+		auto cpus = topology.cpusOfNode(node);
+		if (cpus.empty())
+			throw std::invalid_argument("no usable cpu on NUMA node " + std::to_string(node));
+		return placement(std::move(cpus), true);
+	}
+	/* CPUs the threadIndex-th thread may run on; empty when it is not pinned. */
+	std::vector<unsigned int> cpusFor(unsigned int threadIndex) const {
+		if (order.empty() || wholeSet)
+			return order;
+		return { order[threadIndex % order.size()] };
+	}
+private:
+	placement(std::vector<unsigned int> order, bool wholeSet) : order(std::move(order)), wholeSet(wholeSet) { }
+	static std::vector<unsigned int> ids(const std::vector<cpuTopology::cpu> &cpus) {
+		std::vector<unsigned int> result;
+		for (const auto &c : cpus)
+			result.push_back(c.id);
+		return result;
+	}
+	std::vector<unsigned int> order;
+	bool wholeSet;
+};
+
+/* Restricts the calling thread to cpus (no-op if empty). Returns false when the
+ * affinity cannot be set, e.g. on a non Linux system or outside the process cpuset. */
+static inline bool pinCurrentThread(const std::vector<unsigned int> &cpus) {
+	if (cpus.empty())
+		return true;
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (unsigned int id : cpus)
+		if (id < CPU_SETSIZE)
+			CPU_SET(id, &set);
+	return 0 == pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+	return false;
+#endif
+}
+
+static inline std::vector<unsigned int> &homeCpus(void) {
+	static thread_local std::vector<unsigned int> cpus;
+	return cpus;
+}
+
+/* Pins the calling thread and remembers cpus as the place it returns to. */
+static inline bool placeCurrentThread(std::vector<unsigned int> cpus) {
+	homeCpus() = std::move(cpus);
+	return pinCurrentThread(homeCpus());
+}
+
+/* Moves the calling thread back to the CPUs given to placeCurrentThread(), or to every
+ * usable CPU if it was never placed. */
+static inline bool restoreCurrentThread(void) {
+	if (!homeCpus().empty())
+		return pinCurrentThread(homeCpus());
+	std::vector<unsigned int> all;
+	for (const auto &c : cpuTopology::get().allCpus())
+		all.push_back(c.id);
+	return pinCurrentThread(all);
+}
+
+/* Calls f from a temporary thread running where policy puts its first thread, so the
+ * memory f allocates and initializes is first touched (hence allocated) there. */
+template <typename F>
+auto runOn(const placement &policy, F f) -> decltype(f()) {
+	decltype(f()) result;
+	std::exception_ptr error;
+	std::thread([&]() {
+		pinCurrentThread(policy.cpusFor(0));
+		try {
+			result = f();
+		}
+		catch (...) {
+			error = std::current_exception();
+		}
+	}).join();
+	if (nullptr != error)
+		std::rethrow_exception(error);
+	return result;
+}
+
+}
+
+#endif
@@ -32,8 +32,19 @@
 
 #include <mutex>
 #include <queue>
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <memory>
 #include <condition_variable>
 #include <stdexcept>
+#include <type_traits>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <new>
+#include <cstdlib>
+#include <waitStrategy.h>
 
 namespace threadpool {
 
@@ -55,7 +66,11 @@ public:
 		content.pop();
 		return value;
 	}
+	/* In a FIFO queue, the least urgent message is the oldest one. */
+	void evictLeastUrgent(void) { content.pop(); }
 	bool isEmpty(void) { return (0 == content.size()); }
+	bool isFull(void) { return (maxSize == content.size()); }
+	size_t size(void) { return content.size(); }
 protected:
 	BoundedQueue(size_t maxValues) : content(), maxSize(maxValues) { }
 private:
@@ -65,30 +80,108 @@ private:
 
 class ThreadSafeQueueEmpty : public std::exception { };
 
-template <typename M>
-class ThreadSafeBoundedQueue : private BoundedQueue<M> {
+/* Bounded queue protected by a mutex; Container decides the order in which messages
+ * are popped. Extra push arguments (a priority, a deadline) are given to Container. */
+template <typename M, typename Container>
+class LockedBoundedQueue : protected Container {
 public:
-	ThreadSafeBoundedQueue(size_t maxValues = 50) : BoundedQueue<M>(maxValues), isTerminated(false) { }
-	~ThreadSafeBoundedQueue() = default;
+	LockedBoundedQueue(size_t maxValues) : Container(maxValues), isTerminated(false), nbMessages(0),
+							waitingProducers(0), waitingConsumers(0) { }
+	~LockedBoundedQueue() = default;
 
-	void push(M newValue) {
+	template <typename... Key>
+	void push(M newValue, const Key&... key) {
+		std::unique_lock<std::mutex> lock(mutex);
+
+		waitFor(lock, queueNotFull, waitingProducers, [this]() { return isTerminated || !Container::isFull(); });
+		if (isTerminated)
+			throw std::runtime_error("Cannot push in terminated queue.");
+		Container::push(std::move(newValue), key...);
+		pushed();
+	}
+	/* Pushes newValue unless the queue stays full during timeout; newValue is left
+	 * untouched when it is not pushed. */
+	template <typename Rep, typename Period, typename... Key>
+	bool pushFor(M &newValue, const std::chrono::duration<Rep, Period> &timeout, const Key&... key) {
 		std::unique_lock<std::mutex> lock(mutex);
+		const auto hasRoom = [this]() { return isTerminated || !Container::isFull(); };
 
-		queueNotFull.wait(lock, [this, &newValue]() { return isTerminated || BoundedQueue<M>::push(std::move(newValue)); });
+		if (!hasRoom()) {
+			waitingProducers++;
+			const bool isReady = queueNotFull.wait_for(lock, timeout, hasRoom);
+			waitingProducers--;
+			if (!isReady)
+				return false;
+		}
 		if (isTerminated)
 			throw std::runtime_error("Cannot push in terminated queue.");
-		queueNotEmpty.notify_one();
+		Container::push(std::move(newValue), key...);
+		pushed();
+		return true;
+	}
+	template <typename... Key>
+	bool tryPush(M &newValue, const Key&... key) { return pushFor(newValue, std::chrono::nanoseconds::zero(), key...); }
+	/* Never waits: when the queue is full, the least urgent queued message is discarded
+	 * (the oldest one in FIFO order, the lowest priority or the latest deadline otherwise).
+	 * Returns the number of discarded messages. */
+	template <typename... Key>
+	size_t pushEvictingOldest(M newValue, const Key&... key) {
+		std::unique_lock<std::mutex> lock(mutex);
+		size_t nbEvicted = 0;
+
+		if (isTerminated)
+			throw std::runtime_error("Cannot push in terminated queue.");
+		if (Container::isFull()) {
+			Container::evictLeastUrgent();
+			nbEvicted++;
+		}
+		Container::push(std::move(newValue), key...);
+		pushed();
+		return nbEvicted;
 	}
 	M pop(void) {
+		strategy.spin([this]() { return 0 != nbMessages.load(std::memory_order_acquire); });
 		std::unique_lock<std::mutex> lock(mutex);
 
-		queueNotEmpty.wait(lock, [this]() { return isTerminated || !BoundedQueue<M>::isEmpty(); });
-		if (BoundedQueue<M>::isEmpty())
+		waitFor(lock, queueNotEmpty, waitingConsumers, [this]() { return isTerminated || !Container::isEmpty(); });
+		if (Container::isEmpty())
 			throw ThreadSafeQueueEmpty();
-		if (!isTerminated)
+		if (!isTerminated && 0 < waitingProducers)
 			queueNotFull.notify_one();
-		return BoundedQueue<M>::pop();
+		M value = Container::pop();
+		nbMessages.store(Container::size(), std::memory_order_relaxed);
+		return value;
+	}
+	template <typename Iterator>
+	void pushBatch(Iterator first, Iterator last) {
+		std::unique_lock<std::mutex> lock(mutex);
+
+		while (first != last) {
+			waitFor(lock, queueNotFull, waitingProducers, [this]() { return isTerminated || !Container::isFull(); });
+			if (isTerminated)
+				throw std::runtime_error("Cannot push in terminated queue.");
+			for ( ; first != last && !Container::isFull(); ++first)
+				Container::push(*first);
+			nbMessages.store(Container::size(), std::memory_order_release);
+			if (0 < waitingConsumers)
+				queueNotEmpty.notify_all();
+		}
 	}
+	void popBatch(std::vector<M> &batch, size_t maxCount) {
+		strategy.spin([this]() { return 0 != nbMessages.load(std::memory_order_acquire); });
+		std::unique_lock<std::mutex> lock(mutex);
+
+		waitFor(lock, queueNotEmpty, waitingConsumers, [this]() { return isTerminated || !Container::isEmpty(); });
+		if (Container::isEmpty())
+			throw ThreadSafeQueueEmpty();
+		while (batch.size() < maxCount && !Container::isEmpty())
+			batch.push_back(Container::pop());
+		nbMessages.store(Container::size(), std::memory_order_relaxed);
+		if (!isTerminated && 0 < waitingProducers)
+			queueNotFull.notify_all();
+	}
+	/* Must be called before the queue is shared between threads. */
+	void setWaitStrategy(const waitStrategy &newStrategy) { strategy = newStrategy; }
 	void terminate() {
 		std::lock_guard<std::mutex> lock(mutex);
 
@@ -97,11 +190,701 @@ public:
 		queueNotFull.notify_all();
 	}
 
-private:
+protected:
 	std::mutex mutex;
+private:
+	void pushed(void) {
+		nbMessages.store(Container::size(), std::memory_order_release);
+		if (0 < waitingConsumers)
+			queueNotEmpty.notify_one();
+	}
+	/* The waiting counters let push and pop skip notifying when nobody is waiting. */
+	template <typename Predicate>
+	static void waitFor(std::unique_lock<std::mutex> &lock, std::condition_variable &condition, unsigned int &waiting, Predicate ready) {
+		if (ready())
+			return ;
+		waiting++;
+		condition.wait(lock, ready);
+		waiting--;
+	}
 	std::condition_variable queueNotEmpty;
 	std::condition_variable queueNotFull;
 	bool isTerminated;
+	std::atomic<size_t> nbMessages;
+	unsigned int waitingProducers;
+	unsigned int waitingConsumers;
+	waitStrategy strategy;
+};
+
+template <typename M>
+class ThreadSafeBoundedQueue : public LockedBoundedQueue<M, BoundedQueue<M>> {
+public:
+	ThreadSafeBoundedQueue(size_t maxValues = 50) : LockedBoundedQueue<M, BoundedQueue<M>>(maxValues) { }
+};
+
+/* Messages split into nbBands FIFO bands; a message of band 0 is always popped before
+ * messages of higher bands. Messages added without a priority go to the last band. */
+template <typename M>
+class priorityBands {
+public:
+	static const unsigned int nbBands = 8;
+
+	bool push(M newValue, unsigned int priority = nbBands - 1) {
+		if (maxSize == nbMessages)
+			return false;
+		bands[std::min(priority, nbBands - 1)].push(std::move(newValue));
+		nbMessages++;
+		return true;
+	}
+	M pop(void) {
+		for (auto &band : bands)
+			if (!band.empty()) {
+				auto value = std::move(band.front());
+				band.pop();
+				nbMessages--;
+				return value;
+			}
+		throw std::runtime_error("cannot pop on an empty queue");
+	}
+	/* Discards the oldest message of the lowest priority band in use. */
+	void evictLeastUrgent(void) {
+		for (unsigned int band = nbBands; 0 < band--; )
+			if (!bands[band].empty()) {
+				bands[band].pop();
+				nbMessages--;
+				return ;
+			}
+	}
+	bool isEmpty(void) { return 0 == nbMessages; }
+	bool isFull(void) { return maxSize == nbMessages; }
+	size_t size(void) { return nbMessages; }
+protected:
+	priorityBands(size_t maxValues) : maxSize(maxValues), nbMessages(0) { }
+private:
+	std::queue<M> bands[nbBands];
+	const size_t maxSize;
+	size_t nbMessages;
+};
+
+template <typename M>
+class PriorityBoundedQueue : public LockedBoundedQueue<M, priorityBands<M>> {
+public:
+	static const unsigned int nbBands = priorityBands<M>::nbBands;
+
+	PriorityBoundedQueue(size_t maxValues = 50) : LockedBoundedQueue<M, priorityBands<M>>(maxValues) { }
+};
+
+/* Earliest deadline first; messages with the same deadline are popped in FIFO order.
+ * Messages added without a deadline have none and come after every other message. When
+ * DropExpired holds, messages whose deadline has passed are discarded instead of being
+ * popped. */
+template <typename M, bool DropExpired>
+class deadlineHeap {
+public:
+	typedef std::chrono::steady_clock::time_point deadline;
+
+	bool push(M newValue, deadline messageDeadline = deadline::max()) {
+		if (maxSize == entries.size())
+			return false;
+		entries.push_back(entry { messageDeadline, nextSequence++, std::move(newValue) });
+		std::push_heap(entries.begin(), entries.end(), later);
+		return true;
+	}
+	M pop(void) {
+		if (isEmpty())
+			throw std::runtime_error("cannot pop on an empty queue");
+		std::pop_heap(entries.begin(), entries.end(), later);
+		auto value = std::move(entries.back().value);
+		entries.pop_back();
+		return value;
+	}
+	/* Discards the message that would be popped last: the latest deadline, the newest
+	 * one among equal deadlines. */
+	void evictLeastUrgent(void) {
+		auto last = std::max_element(entries.begin(), entries.end(), [](const entry &a, const entry &b) { return later(b, a); });
+		if (entries.end() == last)
+			return ;
+		*last = std::move(entries.back());
+		entries.pop_back();
+		std::make_heap(entries.begin(), entries.end(), later);
+	}
+	bool isEmpty(void) {
+		if (DropExpired && !entries.empty()) {
+			const auto now = std::chrono::steady_clock::now();
+			size_t expired = 0;
+			while (!entries.empty() && entries.front().messageDeadline < now) {
+				std::pop_heap(entries.begin(), entries.end(), later);
+				entries.pop_back();
+				expired++;
+			}
+			nbDropped += expired;
+			if (0 < expired && dropHandler)
+				dropHandler(expired);
+		}
+		return entries.empty();
+	}
+	bool isFull(void) { return maxSize == entries.size(); }
+	size_t size(void) { return entries.size(); }
+protected:
+	deadlineHeap(size_t maxValues) : maxSize(maxValues), nextSequence(0), nbDropped(0) { }
+
+	size_t droppedMessages(void) const { return nbDropped; }
+
+	std::function<void(size_t)> dropHandler;
+private:
+	struct entry {
+		deadline messageDeadline;
+		unsigned long sequence;
+		M value;
+	};
+	static bool later(const entry &a, const entry &b) {
+		return a.messageDeadline > b.messageDeadline || (a.messageDeadline == b.messageDeadline && a.sequence > b.sequence);
+	}
+	std::vector<entry> entries;
+	const size_t maxSize;
+	unsigned long nextSequence;
+	size_t nbDropped;
+};
+
+template <typename M>
+class DeadlineBoundedQueue : public LockedBoundedQueue<M, deadlineHeap<M, false>> {
+public:
+	DeadlineBoundedQueue(size_t maxValues = 50) : LockedBoundedQueue<M, deadlineHeap<M, false>>(maxValues) { }
+};
+
+/* Deadline queue discarding the messages that expired before being popped. */
+template <typename M>
+class ExpiringDeadlineBoundedQueue : public LockedBoundedQueue<M, deadlineHeap<M, true>> {
+public:
+	ExpiringDeadlineBoundedQueue(size_t maxValues = 50) : LockedBoundedQueue<M, deadlineHeap<M, true>>(maxValues) { }
+	size_t droppedMessages(void) {
+		std::lock_guard<std::mutex> lock(this->mutex);
+
+		return deadlineHeap<M, true>::droppedMessages();
+	}
+	/* handler(n) is called, with the queue locked, every time n messages expire. */
+	void setDropHandler(std::function<void(size_t)> handler) {
+		std::lock_guard<std::mutex> lock(this->mutex);
+
+		this->dropHandler = std::move(handler);
+	}
+};
+
+static const size_t cacheLineSize = 64;
+
+/* Before C++17, new[] ignores alignments stricter than std::max_align_t: arrays of
+ * cache-line aligned types are built in posix_memalign'd memory instead. */
+template <typename T>
+struct alignedArrayDeleter {
+	size_t size;
+	void operator()(T *values) const {
+		for (size_t i = size; 0 < i; i--)
+			values[i - 1].~T();
+		free(values);
+	}
+};
+template <typename T>
+using alignedArray = std::unique_ptr<T[], alignedArrayDeleter<T>>;
+
+template <typename T>
+alignedArray<T> makeAlignedArray(size_t size) {
+	void *memory = nullptr;
+
+	if (0 != posix_memalign(&memory, std::max(alignof(T), sizeof(void *)), std::max<size_t>(size, 1) * sizeof(T)))
+		throw std::bad_alloc();
+	T *values = static_cast<T *>(memory);
+	size_t built = 0;
+	try {
+		for ( ; built < size; built++)
+			new (values + built) T();
+	}
+	catch (...) {
+		alignedArrayDeleter<T> { built }(values);
+		throw;
+	}
+	return alignedArray<T>(values, alignedArrayDeleter<T> { size });
+}
+
+/* Uninitialized room for one message, filled by the non-blocking pops so that
+ * messages do not need to be default constructible. */
+template <typename M>
+class messageSlot {
+public:
+	messageSlot(void) : full(false) { }
+	messageSlot(const messageSlot &) = delete;
+	messageSlot &operator=(const messageSlot &) = delete;
+	~messageSlot(void) {
+		if (full)
+			address()->~M();
+	}
+	bool isEmpty(void) const { return !full; }
+	void fill(M &&value) {
+		new (address()) M(std::move(value));
+		full = true;
+	}
+	M take(void) {
+		M value(std::move(*address()));
+		address()->~M();
+		full = false;
+		return value;
+	}
+private:
+	M *address(void) { return reinterpret_cast<M *>(&storage); }
+	typename std::aligned_storage<sizeof(M), alignof(M)>::type storage;
+	bool full;
+};
+
+static inline size_t capacityFor(size_t maxValues) {
+	size_t capacity = 2;
+	while (capacity < maxValues)
+		capacity <<= 1;
+	return capacity;
+}
+
+/* Bounded multi-producer/multi-consumer ring buffer (D. Vyukov's algorithm): every
+ * slot carries a sequence number telling whether it is ready to be written or read,
+ * so producers and consumers only contend on the position counters. Threads wait
+ * according to the queue waitStrategy only when the queue is really full or empty, and
+ * are woken up only if somebody is actually parked. The capacity is rounded up to a
+ * power of two. */
+template <typename M>
+class LockFreeBoundedQueue {
+public:
+	LockFreeBoundedQueue(size_t maxValues = 50) : mask(capacityFor(maxValues) - 1), cells(new cell[mask + 1]),
+							enqueuePosition(0), dequeuePosition(0), isTerminated(false) {
+		for (size_t i = 0; i <= mask; i++)
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+	}
+	~LockFreeBoundedQueue() {
+		for (size_t position = dequeuePosition.load(); position != enqueuePosition.load(); position++)
+			cells[position & mask].value()->~M();
+	}
+
+	void push(M newValue) {
+		for ( ; ; ) {
+			if (isTerminated.load(std::memory_order_acquire))
+				throw std::runtime_error("Cannot push in terminated queue.");
+			if (tryPush(newValue))
+				return ;
+			park(queueNotFull, [this]() { return isTerminated.load() || !isFull(); });
+		}
+	}
+	M pop(void) {
+		messageSlot<M> slot;
+
+		for ( ; ; ) {
+			if (tryPop(slot))
+				return slot.take();
+			if (isTerminated.load(std::memory_order_acquire) && isEmpty())
+				throw ThreadSafeQueueEmpty();
+			park(queueNotEmpty, [this]() { return isTerminated.load() || !isEmpty(); });
+		}
+	}
+	void terminate() {
+		isTerminated.store(true);
+		queueNotEmpty.notifyAll();
+		queueNotFull.notifyAll();
+	}
+	template <typename Iterator>
+	void pushBatch(Iterator first, Iterator last) {
+		for ( ; first != last; ++first) {
+			M newValue(*first);
+			while (!enqueue(newValue)) {
+				queueNotEmpty.notifyAll();
+				if (isTerminated.load(std::memory_order_acquire))
+					throw std::runtime_error("Cannot push in terminated queue.");
+				park(queueNotFull, [this]() { return isTerminated.load() || !isFull(); });
+			}
+		}
+		queueNotEmpty.notifyAll();
+	}
+	void popBatch(std::vector<M> &batch, size_t maxCount) {
+		const auto append = [&batch](M &&value) { batch.push_back(std::move(value)); };
+
+		for ( ; ; ) {
+			while (batch.size() < maxCount && dequeue(append))
+				;
+			if (!batch.empty()) {
+				queueNotFull.notifyAll();
+				return ;
+			}
+			if (isTerminated.load(std::memory_order_acquire) && isEmpty())
+				throw ThreadSafeQueueEmpty();
+			park(queueNotEmpty, [this]() { return isTerminated.load() || !isEmpty(); });
+		}
+	}
+	bool tryPush(M &newValue) {
+		if (!enqueue(newValue))
+			return false;
+		queueNotEmpty.notifyOne();
+		return true;
+	}
+	template <typename Rep, typename Period>
+	bool pushFor(M &newValue, const std::chrono::duration<Rep, Period> &timeout) {
+		const auto deadline = std::chrono::steady_clock::now() + timeout;
+		const auto hasRoom = [this]() { return isTerminated.load() || !isFull(); };
+
+		for ( ; ; ) {
+			if (isTerminated.load(std::memory_order_acquire))
+				throw std::runtime_error("Cannot push in terminated queue.");
+			if (tryPush(newValue))
+				return true;
+			if (!strategy.spin(hasRoom) && !queueNotFull.waitUntil(hasRoom, deadline))
+				return false;
+		}
+	}
+	size_t pushEvictingOldest(M newValue) {
+		const auto discard = [](M &&) { };
+		size_t nbEvicted = 0;
+
+		if (isTerminated.load(std::memory_order_acquire))
+			throw std::runtime_error("Cannot push in terminated queue.");
+		while (!enqueue(newValue))
+			if (dequeue(discard))
+				nbEvicted++;
+		queueNotEmpty.notifyOne();
+		return nbEvicted;
+	}
+	bool tryPop(messageSlot<M> &slot) {
+		if (!dequeue([&slot](M &&value) { slot.fill(std::move(value)); }))
+			return false;
+		queueNotFull.notifyOne();
+		return true;
+	}
+	bool isEmpty(void) {
+		const size_t position = dequeuePosition.load(std::memory_order_relaxed);
+		return 0 > distance(cells[position & mask].sequence.load(std::memory_order_acquire), position + 1);
+	}
+	/* Must be called before the queue is shared between threads. */
+	void setWaitStrategy(const waitStrategy &newStrategy) { strategy = newStrategy; }
+private:
+	struct cell {
+		std::atomic<size_t> sequence;
+		typename std::aligned_storage<sizeof(M), alignof(M)>::type storage;
+		M *value(void) { return reinterpret_cast<M *>(&storage); }
+	};
+
+	static ptrdiff_t distance(size_t sequence, size_t position) { return static_cast<ptrdiff_t>(sequence - position); }
+	bool enqueue(M &newValue) {
+		size_t position = enqueuePosition.load(std::memory_order_relaxed);
+		for ( ; ; ) {
+			cell *c = &cells[position & mask];
+			const auto diff = distance(c->sequence.load(std::memory_order_acquire), position);
+			if (0 == diff && enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+				new (c->value()) M(std::move(newValue));
+				c->sequence.store(position + 1, std::memory_order_release);
+				return true;
+			}
+			if (0 > diff)
+				return false;
+			if (0 < diff)
+				position = enqueuePosition.load(std::memory_order_relaxed);
+		}
+	}
+	template <typename Sink>
+	bool dequeue(const Sink &sink) {
+		size_t position = dequeuePosition.load(std::memory_order_relaxed);
+		for ( ; ; ) {
+			cell *c = &cells[position & mask];
+			const auto diff = distance(c->sequence.load(std::memory_order_acquire), position + 1);
+			if (0 == diff && dequeuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+				sink(std::move(*c->value()));
+				c->value()->~M();
+				c->sequence.store(position + mask + 1, std::memory_order_release);
+				return true;
+			}
+			if (0 > diff)
+				return false;
+			if (0 < diff)
+				position = dequeuePosition.load(std::memory_order_relaxed);
+		}
+	}
+	bool isFull(void) {
+		const size_t position = enqueuePosition.load(std::memory_order_relaxed);
+		return 0 > distance(cells[position & mask].sequence.load(std::memory_order_acquire), position);
+	}
+	template <typename Predicate>
+	void park(eventCount &event, Predicate ready) {
+		if (!strategy.spin(ready))
+			event.wait(ready);
+	}
+
+	const size_t mask;
+	const std::unique_ptr<cell[]> cells;
+	alignas(cacheLineSize) std::atomic<size_t> enqueuePosition;
+	alignas(cacheLineSize) std::atomic<size_t> dequeuePosition;
+	alignas(cacheLineSize) std::atomic<bool> isTerminated;
+	eventCount queueNotEmpty;
+	eventCount queueNotFull;
+	waitStrategy strategy;
+};
+
+
+/* Work-stealing scheduling: every worker owns a bounded Chase-Lev deque. Messages
+ * added from outside the pool go through a shared injection queue, whereas messages
+ * added by a worker (from its body) go to its own deque and are popped LIFO for
+ * locality. A worker without local work takes from the injection queue, then steals
+ * (FIFO) from randomly chosen victims, and parks only when there is nothing anywhere.
+ * When its deque is full, a worker adds to an unbounded overflow list rather than to
+ * the injection queue: a worker never blocks on a push, and workers may keep adding
+ * messages while the pool drains after terminate(). */
+template <typename M>
+class WorkStealingQueue {
+public:
+	WorkStealingQueue(size_t maxValues, unsigned int nbWorkers) : id(nextId()), nbWorkers(nbWorkers), workers(makeAlignedArray<workerDeque>(nbWorkers)),
+							injection(maxValues), overflowSize(0), registeredWorkers(0), isTerminated(false) {
+		for (unsigned int i = 0; i < nbWorkers; i++)
+			workers[i].allocate(capacityFor(maxValues));
+	}
+	~WorkStealingQueue() = default;
+
+	void push(M newValue) {
+		workerDeque *self = localDeque();
+
+		if (nullptr == self) {
+			if (isTerminated.load(std::memory_order_acquire))
+				throw std::runtime_error("Cannot push in terminated queue.");
+			injection.push(std::move(newValue));
+		}
+		else if (!self->push(newValue))
+			pushOverflow(std::move(newValue));
+		workAvailable.notifyOne();
+	}
+	bool tryPush(M &newValue) { return pushFor(newValue, std::chrono::nanoseconds::zero()); }
+	template <typename Rep, typename Period>
+	bool pushFor(M &newValue, const std::chrono::duration<Rep, Period> &timeout) {
+		workerDeque *self = localDeque();
+
+		if (nullptr == self) {
+			if (isTerminated.load(std::memory_order_acquire))
+				throw std::runtime_error("Cannot push in terminated queue.");
+			if (!injection.pushFor(newValue, timeout))
+				return false;
+		}
+		else if (!self->push(newValue))
+			pushOverflow(std::move(newValue));
+		workAvailable.notifyOne();
+		return true;
+	}
+	size_t pushEvictingOldest(M newValue) {
+		workerDeque *self = localDeque();
+		size_t nbEvicted = 0;
+
+		if (nullptr == self) {
+			if (isTerminated.load(std::memory_order_acquire))
+				throw std::runtime_error("Cannot push in terminated queue.");
+			nbEvicted = injection.pushEvictingOldest(std::move(newValue));
+		}
+		else if (!self->push(newValue))
+			pushOverflow(std::move(newValue));
+		workAvailable.notifyOne();
+		return nbEvicted;
+	}
+	template <typename Iterator>
+	void pushBatch(Iterator first, Iterator last) {
+		workerDeque *self = localDeque();
+
+		if (nullptr == self) {
+			if (isTerminated.load(std::memory_order_acquire))
+				throw std::runtime_error("Cannot push in terminated queue.");
+			injection.pushBatch(first, last);
+		}
+		else {
+			for ( ; first != last; ++first) {
+				M newValue(*first);
+				if (!self->push(newValue))
+					pushOverflow(std::move(newValue));
+			}
+		}
+		workAvailable.notifyAll();
+	}
+	M pop(void) {
+		workerDeque *self = registerWorker();
+		messageSlot<M> slot;
+
+		for ( ; ; ) {
+			if (tryTake(self, slot))
+				return slot.take();
+			if (isTerminated.load(std::memory_order_acquire) && !hasWork())
+				throw ThreadSafeQueueEmpty();
+			const auto ready = [this]() { return isTerminated.load() || hasWork(); };
+			if (!strategy.spin(ready))
+				workAvailable.wait(ready);
+		}
+	}
+	void terminate() {
+		isTerminated.store(true);
+		injection.terminate();
+		workAvailable.notifyAll();
+	}
+	/* Must be called before the queue is shared between threads. */
+	void setWaitStrategy(const waitStrategy &newStrategy) {
+		strategy = newStrategy;
+		injection.setWaitStrategy(newStrategy);
+	}
+	/* Non-blocking pop, usable from any thread: the caller's own deque first (if it is a
+	 * worker of this queue), then the injection queue, then the other workers. */
+	bool tryPop(messageSlot<M> &slot) { return tryTake(localDeque(), slot); }
+	void popBatch(std::vector<M> &batch, size_t maxCount) {
+		batch.push_back(pop());
+
+		workerDeque *self = localDeque();
+		messageSlot<M> slot;
+		while (batch.size() < maxCount && tryTake(self, slot))
+			batch.push_back(slot.take());
+	}
+private:
+	class workerDeque {
+	public:
+		workerDeque(void) : mask(0), top(0), bottom(0) { }
+		~workerDeque(void) {
+			for (ptrdiff_t i = top.load(); i < bottom.load(); i++)
+				cells[i & mask].value()->~M();
+		}
+		void allocate(size_t capacity) {
+			mask = capacity - 1;
+			cells.reset(new cell[capacity]);
+		}
+		/* owner only */
+		bool push(M &newValue) {
+			const ptrdiff_t b = bottom.load(std::memory_order_relaxed);
+			cell &c = cells[b & mask];
+
+			if (b - top.load(std::memory_order_acquire) > static_cast<ptrdiff_t>(mask) || c.busy.load(std::memory_order_acquire))
+				return false;
+			new (c.value()) M(std::move(newValue));
+			c.busy.store(true, std::memory_order_relaxed);
+			bottom.store(b + 1, std::memory_order_release);
+			return true;
+		}
+		/* owner only */
+		bool pop(messageSlot<M> &slot) {
+			const ptrdiff_t b = bottom.load(std::memory_order_relaxed) - 1;
+
+			bottom.store(b, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			ptrdiff_t t = top.load(std::memory_order_relaxed);
+			if (t > b) {
+				bottom.store(b + 1, std::memory_order_relaxed);
+				return false;
+			}
+			if (t == b) {
+				const bool won = top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+				bottom.store(b + 1, std::memory_order_relaxed);
+				if (!won)
+					return false;
+			}
+			take(cells[b & mask], slot);
+			return true;
+		}
+		bool steal(messageSlot<M> &slot) {
+			ptrdiff_t t = top.load(std::memory_order_acquire);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			const ptrdiff_t b = bottom.load(std::memory_order_acquire);
+
+			if (t >= b || !top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+				return false;
+			take(cells[t & mask], slot);
+			return true;
+		}
+		bool isEmpty(void) { return top.load(std::memory_order_acquire) >= bottom.load(std::memory_order_acquire); }
+	private:
+		/* busy stays set until the message has been moved out, so that the owner
+		 * never overwrites a slot a thief is still reading. */
+		struct cell {
+			std::atomic<bool> busy {false};
+			typename std::aligned_storage<sizeof(M), alignof(M)>::type storage;
+			M *value(void) { return reinterpret_cast<M *>(&storage); }
+		};
+		static void take(cell &c, messageSlot<M> &slot) {
+			slot.fill(std::move(*c.value()));
+			c.value()->~M();
+			c.busy.store(false, std::memory_order_release);
+		}
+		size_t mask;
+		std::unique_ptr<cell[]> cells;
+		alignas(cacheLineSize) std::atomic<ptrdiff_t> top;
+		alignas(cacheLineSize) std::atomic<ptrdiff_t> bottom;
+	};
+	struct workerIdentity {
+		unsigned long queueId;
+		workerDeque *deque;
+		unsigned int seed;
+	};
+
+	static unsigned long nextId(void) {
+		static std::atomic<unsigned long> id {1};
+		return id++;
+	}
+	static workerIdentity &identity(void) {
+		static thread_local workerIdentity current {0, nullptr, 0};
+		return current;
+	}
+	workerDeque *localDeque(void) {
+		const auto &current = identity();
+		return (id == current.queueId) ? current.deque : nullptr;
+	}
+	workerDeque *registerWorker(void) {
+		auto &current = identity();
+		if (id != current.queueId) {
+			const unsigned int index = registeredWorkers++;
+			current.queueId = id;
+			current.deque = (index < nbWorkers) ? &workers[index] : nullptr;
+			current.seed = index * 2654435761u + 1;
+		}
+		return current.deque;
+	}
+	void pushOverflow(M &&newValue) {
+		std::lock_guard<std::mutex> lock(overflowMutex);
+
+		overflow.push_back(std::move(newValue));
+		overflowSize.fetch_add(1);
+	}
+	bool popOverflow(messageSlot<M> &slot) {
+		if (0 == overflowSize.load())
+			return false;
+		std::lock_guard<std::mutex> lock(overflowMutex);
+		if (overflow.empty())
+			return false;
+		slot.fill(std::move(overflow.front()));
+		overflow.pop_front();
+		overflowSize.fetch_sub(1);
+		return true;
+	}
+	bool tryTake(workerDeque *self, messageSlot<M> &slot) {
+		if ((nullptr != self && self->pop(slot)) || injection.tryPop(slot) || popOverflow(slot))
+			return true;
+		auto &seed = identity().seed;
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		for (unsigned int i = 0; i < nbWorkers; i++) {
+			workerDeque &victim = workers[(seed + i) % nbWorkers];
+			if (&victim != self && victim.steal(slot))
+				return true;
+		}
+		return false;
+	}
+	bool hasWork(void) {
+		if (!injection.isEmpty() || 0 != overflowSize.load())
+			return true;
+		for (unsigned int i = 0; i < nbWorkers; i++)
+			if (!workers[i].isEmpty())
+				return true;
+		return false;
+	}
+
+	const unsigned long id;
+	const unsigned int nbWorkers;
+	const alignedArray<workerDeque> workers;
+	LockFreeBoundedQueue<M> injection;
+	std::mutex overflowMutex;
+	std::deque<M> overflow;
+	std::atomic<size_t> overflowSize;
+	std::atomic<unsigned int> registeredWorkers;
+	std::atomic<bool> isTerminated;
+	eventCount workAvailable;
+	waitStrategy strategy;
 };
 
 }
@@ -30,27 +30,180 @@
 #ifndef REDUCE_H__
 #define REDUCE_H__
 
+#include <threadpool.h>
+#include <map.h>
 #include <queue>
+#include <vector>
+#include <unordered_map>
 
 using namespace threadpool;
 
-template<typename M>
-M associativeReduce(const std::vector<M> &v, M initialValue, std::function<M (std::pair<const M, const M>)> f, ThreadCache &cache) {
-	struct ReduceData {
-		std::pair<const M, const M> value;
-		ThreadSafeBoundedQueue<M> &q;
-		ReduceData(M&& v1, M&& v2, ThreadSafeBoundedQueue<M> &queue) : value(v1, v2), q(queue) {}
-		ReduceData(const M& v1, const M& v2, ThreadSafeBoundedQueue<M> &queue) : value(v1, v2), q(queue) {}
+/* Log-depth combination of per-worker partial results. Every node of the binary tree
+ * sits on its own cache line; the second child to arrive combines both children into
+ * their parent, so partial results are merged in parallel and in order. */
+template <typename M, typename Op>
+class combiningTree {
+public:
+	combiningTree(unsigned int nbLeaves, Op &op) : nbLeaves(nbLeaves), firstLeaf(leafCount(nbLeaves)), nodes(makeAlignedArray<node>(2 * firstLeaf)), op(op) { }
+	void arrive(unsigned int leaf, M value) {
+		nodes[firstLeaf + leaf].value.fill(std::move(value));
+		climb(firstLeaf + leaf);
+	}
+	void arrive(unsigned int leaf) { climb(firstLeaf + leaf); }
+	messageSlot<M> &result(void) { return nodes[1].value; }
+private:
+	struct alignas(cacheLineSize) node {
+		messageSlot<M> value;
+		std::atomic<unsigned int> arrivals {0};
 	};
-	if (0 == v.size())
+	static unsigned int leafCount(unsigned int nbLeaves) {
+		unsigned int count = 1;
+		while (count < nbLeaves)
+			count <<= 1;
+		return count;
+	}
+	bool isPresent(unsigned int index) const {
+		while (index < firstLeaf)
+			index *= 2;
+		return index - firstLeaf < nbLeaves;
+	}
+	void climb(unsigned int index) {
+		for ( ; 1 < index; index /= 2) {
+			const unsigned int parent = index / 2;
+			if (isPresent(index ^ 1) && 0 == nodes[parent].arrivals.fetch_add(1, std::memory_order_acq_rel))
+				return ;
+			combine(nodes[parent].value, nodes[2 * parent].value, nodes[2 * parent + 1].value);
+		}
+	}
+	void combine(messageSlot<M> &parent, messageSlot<M> &left, messageSlot<M> &right) {
+		if (!left.isEmpty() && !right.isEmpty())
+			parent.fill(op(left.take(), right.take()));
+		else if (!left.isEmpty())
+			parent.fill(left.take());
+		else if (!right.isEmpty())
+			parent.fill(right.take());
+	}
+	const unsigned int nbLeaves;
+	const unsigned int firstLeaf;
+	const alignedArray<node> nodes;
+	Op &op;
+};
+
+/* Reduces [first, last) with an associative operator: every worker reduces one contiguous
+ * block and the blocks are combined in order, so op does not need to be commutative. */
+template<typename Iterator, typename M, typename Op, typename Workers>
+M associativeReduce(Iterator first, Iterator last, M initialValue, Op op, Workers &workers) {
+	const size_t size = static_cast<size_t>(last - first);
+	if (0 == size)
+		return initialValue;
+	const unsigned int nbWorkers = workersFor(size, workers);
+	combiningTree<M, Op> tree(nbWorkers, op);
+	runOnWorkers(nbWorkers, [first, size, nbWorkers, &op, &tree](unsigned int worker) {
+		const size_t end = size * (worker + 1) / nbWorkers;
+		size_t i = size * worker / nbWorkers;
+		M value(first[i]);
+		for (i++; i < end; i++)
+			value = op(std::move(value), first[i]);
+		tree.arrive(worker, std::move(value));
+	}, workers);
+	return op(std::move(initialValue), tree.result().take());
+}
+
+/* Reduces [first, last) with an associative and commutative operator: chunks are handed
+ * out dynamically and every worker folds them into its own accumulator in any order. */
+template<typename Iterator, typename M, typename Op, typename Workers>
+M commutativeReduce(Iterator first, Iterator last, M initialValue, Op op, Workers &workers, size_t grainSize = 0) {
+	const size_t size = static_cast<size_t>(last - first);
+	if (0 == size)
+		return initialValue;
+	const unsigned int nbWorkers = workersFor(size, workers);
+	chunkScheduler chunks(size, nbWorkers, schedule::DYNAMIC, grainSize);
+	combiningTree<M, Op> tree(nbWorkers, op);
+	runOnWorkers(nbWorkers, [first, &op, &chunks, &tree](unsigned int worker) {
+		messageSlot<M> accumulator;
+		auto fold = [first, &op, &accumulator](size_t begin, size_t end) {
+			M value(accumulator.isEmpty() ? first[begin++] : accumulator.take());
+			for ( ; begin < end; begin++)
+				value = op(std::move(value), first[begin]);
+			accumulator.fill(std::move(value));
+		};
+		chunks.run(worker, fold);
+		if (accumulator.isEmpty())
+			tree.arrive(worker);
+		else
+			tree.arrive(worker, accumulator.take());
+	}, workers);
+	messageSlot<M> &result = tree.result();
+	return result.isEmpty() ? initialValue : op(std::move(initialValue), result.take());
+}
+
+/* Reduces the transformed elements of [first, last) in a single pass, without storing
+ * them: every worker transforms and folds one contiguous block into an accumulator of the
+ * type of initialValue, and the blocks are combined in order. reduce must be associative
+ * and accept (A, A) as well as (A, transformed element); A must be constructible from a
+ * transformed element. */
+template<typename Iterator, typename A, typename Transform, typename Op, typename Workers>
+A transformReduce(Iterator first, Iterator last, A initialValue, Transform transform, Op reduce, Workers &workers) {
+	const size_t size = static_cast<size_t>(last - first);
+	if (0 == size)
 		return initialValue;
-	unsigned int pending {1};
-	ThreadSafeBoundedQueue<M> q;
-	Threadpool<ReduceData> pool(doNothing, [f] (ReduceData data) { data.q.push(f(std::move(data.value))); }, doNothing, 10, 10, cache);
-	pool.add(ReduceData(v[0], std::move(initialValue), q));
-	for (; pending < v.size() / 2; pending++) { pool.add(ReduceData(v[pending], v[pending + 1], q)); }
-	for (; 1 < pending; pending--) { pool.add(ReduceData(std::move(q.pop()), std::move(q.pop()), q)); }
-	return (0 == (v.size() + 1) % 2) ? q.pop() : f(std::pair<const M, const M>(q.pop(), v[v.size() - 1]));
+	const unsigned int nbWorkers = workersFor(size, workers);
+	combiningTree<A, Op> tree(nbWorkers, reduce);
+	runOnWorkers(nbWorkers, [first, size, nbWorkers, &transform, &reduce, &tree](unsigned int worker) {
+		const size_t end = size * (worker + 1) / nbWorkers;
+		size_t i = size * worker / nbWorkers;
+		A value(transform(first[i]));
+		for (i++; i < end; i++)
+			value = reduce(std::move(value), transform(first[i]));
+		tree.arrive(worker, std::move(value));
+	}, workers);
+	return reduce(std::move(initialValue), tree.result().take());
+}
+
+/* Keyed variant of transformReduce: the transformed elements are reduced per key(element).
+ * Every worker builds its own table for one block and the tables are merged in block order,
+ * so reduce only needs to be associative. */
+template<typename Iterator, typename Key, typename Transform, typename Op, typename Workers,
+		typename K = std::decay_t<std::result_of_t<Key(decltype(*std::declval<Iterator>()))>>,
+		typename A = std::decay_t<std::result_of_t<Transform(decltype(*std::declval<Iterator>()))>>>
+std::unordered_map<K, A> transformReduceByKey(Iterator first, Iterator last, Key key, Transform transform, Op reduce, Workers &workers) {
+	typedef std::unordered_map<K, A> table;
+	const size_t size = static_cast<size_t>(last - first);
+	if (0 == size)
+		return table();
+	auto merge = [&reduce](table left, table right) {
+		for (auto &entry : right) {
+			auto found = left.find(entry.first);
+			if (left.end() == found)
+				left.emplace(entry.first, std::move(entry.second));
+			else
+				found->second = reduce(std::move(found->second), std::move(entry.second));
+		}
+		return left;
+	};
+	const unsigned int nbWorkers = workersFor(size, workers);
+	combiningTree<table, decltype(merge)> tree(nbWorkers, merge);
+	runOnWorkers(nbWorkers, [first, size, nbWorkers, &key, &transform, &reduce, &tree](unsigned int worker) {
+		const size_t end = size * (worker + 1) / nbWorkers;
+		table partial;
+		for (size_t i = size * worker / nbWorkers; i < end; i++) {
+			K k(key(first[i]));
+			auto found = partial.find(k);
+			if (partial.end() == found)
+				partial.emplace(std::move(k), transform(first[i]));
+			else
+				found->second = reduce(std::move(found->second), transform(first[i]));
+		}
+		tree.arrive(worker, std::move(partial));
+	}, workers);
+	return tree.result().take();
+}
+
+template<typename M>
+M associativeReduce(const std::vector<M> &v, M initialValue, std::function<M (std::pair<const M, const M>)> f, ThreadCache &cache) {
+	return associativeReduce(v.begin(), v.end(), std::move(initialValue), [&f](M left, const M &right) {
+		return f(std::pair<const M, const M>(std::move(left), right));
+	}, cache);
 }
 
 
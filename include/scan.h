@@ -0,0 +1,185 @@
+/* Copyright 2016 Laurent Van Begin
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE OpenSSL PROJECT ``AS IS'' AND ANY
+ * EXPRESSED OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE OpenSSL PROJECT OR
+ * ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+  */
+
+#ifndef SCAN_H__
+#define SCAN_H__
+
+#include <threadpool.h>
+#include <map.h>
+#include <iterator>
+#include <memory>
+#include <vector>
+#include <utility>
+
+using namespace threadpool;
+
+/* Two-pass blocked algorithms: every worker owns one contiguous block. The first pass
+ * summarizes the blocks (a partial reduction or a count), the summaries are combined
+ * sequentially into per-block offsets, and the second pass writes every block straight
+ * into the preallocated output. */
+
+static inline size_t blockBegin(size_t size, unsigned int nbBlocks, unsigned int block) { return size * block / nbBlocks; }
+
+/* Reduces every block but the last one; sums[block] is filled with the block result. */
+template<typename InputIterator, typename M, typename Op>
+void reduceBlocks(InputIterator first, size_t size, unsigned int nbBlocks, Op &op, messageSlot<M> *sums, ThreadCache &cache) {
+	runOnWorkers(nbBlocks, [first, size, nbBlocks, &op, sums](unsigned int block) {
+		if (block + 1 == nbBlocks)
+			return ;
+		const size_t end = blockBegin(size, nbBlocks, block + 1);
+		size_t i = blockBegin(size, nbBlocks, block);
+		M value(first[i]);
+		for (i++; i < end; i++)
+			value = op(std::move(value), first[i]);
+		sums[block].fill(std::move(value));
+	}, cache);
+}
+
+/* output[i] = first[0] op ... op first[i]; output may be first. Returns the end of the output. */
+template<typename InputIterator, typename OutputIterator, typename Op>
+OutputIterator inclusiveScan(InputIterator first, InputIterator last, OutputIterator output, Op op, ThreadCache &cache) {
+	typedef typename std::iterator_traits<InputIterator>::value_type M;
+	const size_t size = static_cast<size_t>(last - first);
+	if (0 == size)
+		return output;
+	const unsigned int nbBlocks = workersFor(size, cache);
+	std::unique_ptr<messageSlot<M>[]> sums(new messageSlot<M>[nbBlocks]);
+	std::vector<M> carries;
+
+	reduceBlocks(first, size, nbBlocks, op, sums.get(), cache);
+	for (unsigned int block = 0; block + 1 < nbBlocks; block++)
+		carries.push_back(carries.empty() ? sums[block].take() : op(carries.back(), sums[block].take()));
+	runOnWorkers(nbBlocks, [first, output, size, nbBlocks, &op, &carries](unsigned int block) {
+		const size_t end = blockBegin(size, nbBlocks, block + 1);
+		size_t i = blockBegin(size, nbBlocks, block);
+		M value((0 == block) ? M(first[i]) : op(carries[block - 1], first[i]));
+		output[i] = value;
+		for (i++; i < end; i++) {
+			value = op(std::move(value), first[i]);
+			output[i] = value;
+		}
+	}, cache);
+	return output + size;
+}
+
+/* output[i] = initialValue op first[0] op ... op first[i - 1]; output may be first.
+ * Returns the end of the output. */
+template<typename InputIterator, typename OutputIterator, typename M, typename Op>
+OutputIterator exclusiveScan(InputIterator first, InputIterator last, OutputIterator output, M initialValue, Op op, ThreadCache &cache) {
+	const size_t size = static_cast<size_t>(last - first);
+	if (0 == size)
+		return output;
+	const unsigned int nbBlocks = workersFor(size, cache);
+	std::unique_ptr<messageSlot<M>[]> sums(new messageSlot<M>[nbBlocks]);
+	std::vector<M> carries { std::move(initialValue) };
+
+	reduceBlocks(first, size, nbBlocks, op, sums.get(), cache);
+	for (unsigned int block = 0; block + 1 < nbBlocks; block++)
+		carries.push_back(op(carries.back(), sums[block].take()));
+	runOnWorkers(nbBlocks, [first, output, size, nbBlocks, &op, &carries](unsigned int block) {
+		const size_t end = blockBegin(size, nbBlocks, block + 1);
+		M value(carries[block]);
+		for (size_t i = blockBegin(size, nbBlocks, block); i < end; i++) {
+			M next(op(value, first[i]));
+			output[i] = std::move(value);
+			value = std::move(next);
+		}
+	}, cache);
+	return output + size;
+}
+
+/* Evaluates pred once per element, keeping the results in flags, and counts the
+ * selected elements of every block. */
+template<typename InputIterator, typename Predicate>
+std::vector<size_t> countBlocks(InputIterator first, size_t size, unsigned int nbBlocks, Predicate &pred, std::vector<unsigned char> &flags, ThreadCache &cache) {
+	std::vector<size_t> counts(nbBlocks);
+
+	runOnWorkers(nbBlocks, [first, size, nbBlocks, &pred, &flags, &counts](unsigned int block) {
+		size_t count = 0;
+		for (size_t i = blockBegin(size, nbBlocks, block); i < blockBegin(size, nbBlocks, block + 1); i++) {
+			flags[i] = pred(first[i]) ? 1 : 0;
+			count += flags[i];
+		}
+		counts[block] = count;
+	}, cache);
+	return counts;
+}
+
+/* Copies the elements satisfying pred to output, keeping their order (stream
+ * compaction). Returns the end of the output. */
+template<typename InputIterator, typename OutputIterator, typename Predicate>
+OutputIterator filter(InputIterator first, InputIterator last, OutputIterator output, Predicate pred, ThreadCache &cache) {
+	const size_t size = static_cast<size_t>(last - first);
+	if (0 == size)
+		return output;
+	const unsigned int nbBlocks = workersFor(size, cache);
+	std::vector<unsigned char> flags(size);
+	std::vector<size_t> offsets = countBlocks(first, size, nbBlocks, pred, flags, cache);
+	size_t total = 0;
+
+	for (auto &offset : offsets)
+		total += std::exchange(offset, total);
+	runOnWorkers(nbBlocks, [first, output, size, nbBlocks, &flags, &offsets](unsigned int block) {
+		OutputIterator out = output + offsets[block];
+		for (size_t i = blockBegin(size, nbBlocks, block); i < blockBegin(size, nbBlocks, block + 1); i++)
+			if (flags[i])
+				*out++ = first[i];
+	}, cache);
+	return output + total;
+}
+
+/* Stable partition of [first, last) into output: the elements satisfying pred first,
+ * then the others, both in their original order. Returns the partition point. */
+template<typename InputIterator, typename OutputIterator, typename Predicate>
+OutputIterator partition(InputIterator first, InputIterator last, OutputIterator output, Predicate pred, ThreadCache &cache) {
+	const size_t size = static_cast<size_t>(last - first);
+	if (0 == size)
+		return output;
+	const unsigned int nbBlocks = workersFor(size, cache);
+	std::vector<unsigned char> flags(size);
+	std::vector<size_t> selected = countBlocks(first, size, nbBlocks, pred, flags, cache);
+	std::vector<size_t> rejected(nbBlocks);
+	size_t nbSelected = 0, nbRejected = 0;
+
+	for (unsigned int block = 0; block < nbBlocks; block++) {
+		const size_t blockSize = blockBegin(size, nbBlocks, block + 1) - blockBegin(size, nbBlocks, block);
+		rejected[block] = nbRejected;
+		nbRejected += blockSize - selected[block];
+		nbSelected += std::exchange(selected[block], nbSelected);
+	}
+	runOnWorkers(nbBlocks, [first, output, size, nbBlocks, nbSelected, &flags, &selected, &rejected](unsigned int block) {
+		OutputIterator in = output + selected[block];
+		OutputIterator out = output + nbSelected + rejected[block];
+		for (size_t i = blockBegin(size, nbBlocks, block); i < blockBegin(size, nbBlocks, block + 1); i++)
+			*(flags[i] ? in++ : out++) = first[i];
+	}, cache);
+	return output + nbSelected;
+}
+
+#endif
@@ -0,0 +1,188 @@
+/* Copyright 2016 Laurent Van Begin
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE OpenSSL PROJECT ``AS IS'' AND ANY
+ * EXPRESSED OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE OpenSSL PROJECT OR
+ * ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+  */
+
+#ifndef SORT_H__
+#define SORT_H__
+
+#include <threadpool.h>
+#include <map.h>
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <vector>
+#include <memory>
+
+using namespace threadpool;
+
+/* Below this size, sorting is left to the sequential algorithm. */
+static const size_t sequentialSortCutoff = 1 << 13;
+
+/* Part of the merge of two sorted runs [a, aEnd) and [b, bEnd) written from output. */
+template<typename Iterator, typename OutputIterator>
+struct mergeTask {
+	Iterator a, aEnd, b, bEnd;
+	OutputIterator output;
+};
+
+/* Number of elements of a to take among the first k elements of the merge of a and b;
+ * on equal elements those of a come first, which keeps the merge stable. */
+template<typename Iterator, typename Compare>
+size_t mergeSplit(Iterator a, size_t aSize, Iterator b, size_t bSize, size_t k, Compare &comp) {
+	size_t low = (k > bSize) ? k - bSize : 0, high = std::min(k, aSize);
+	while (low < high) {
+		const size_t i = (low + high) / 2, j = k - i;
+		if (j > 0 && i < aSize && !comp(b[j - 1], a[i]))
+			low = i + 1;
+		else
+			high = i;
+	}
+	return low;
+}
+
+/* Merges runs of width elements of [from, from + size) pairwise into to. Every merge is
+ * cut in pieces of about size / nbWorkers elements so that all workers are busy even
+ * when only a few runs are left. */
+template<typename Iterator, typename OutputIterator, typename Compare>
+void mergeRuns(Iterator from, OutputIterator to, size_t size, size_t width, unsigned int nbWorkers, Compare &comp, ThreadCache &cache) {
+	const size_t piece = std::max<size_t>(1, size / nbWorkers);
+	std::vector<mergeTask<Iterator, OutputIterator>> tasks;
+
+	for (size_t begin = 0; begin < size; begin += 2 * width) {
+		const size_t middle = std::min(size, begin + width), end = std::min(size, begin + 2 * width);
+		const Iterator a = from + begin, b = from + middle;
+		const size_t aSize = middle - begin, bSize = end - middle;
+		for (size_t k = 0; k < aSize + bSize; k += piece) {
+			const size_t kEnd = std::min(aSize + bSize, k + piece);
+			const size_t i = mergeSplit(a, aSize, b, bSize, k, comp), iEnd = mergeSplit(a, aSize, b, bSize, kEnd, comp);
+			tasks.push_back(mergeTask<Iterator, OutputIterator> { a + i, a + iEnd, b + (k - i), b + (kEnd - iEnd), to + begin + k });
+		}
+	}
+	forEachChunk(tasks.size(), [&tasks, &comp](size_t first, size_t last) {
+		for (size_t t = first; t < last; t++) {
+			const auto &task = tasks[t];
+			std::merge(std::make_move_iterator(task.a), std::make_move_iterator(task.aEnd),
+				   std::make_move_iterator(task.b), std::make_move_iterator(task.bEnd), task.output, comp);
+		}
+	}, cache, schedule::DYNAMIC, 1);
+}
+
+/* Uninitialized room for the elements of a sort, filled block by block by moving the
+ * sorted blocks in, so that elements need not be default constructible. Only the blocks
+ * that were filled are destroyed. */
+template <typename M>
+class sortScratch {
+public:
+	sortScratch(size_t size, size_t width, unsigned int nbBlocks) : values(std::allocator<M>().allocate(size)), size(size), width(width),
+									filled(nbBlocks, 0) { }
+	sortScratch(const sortScratch &) = delete;
+	sortScratch &operator=(const sortScratch &) = delete;
+	~sortScratch(void) {
+		for (size_t block = 0; block < filled.size(); block++)
+			if (filled[block])
+				for (M *v = values + begin(block); v != values + end(block); v++)
+					v->~M();
+		std::allocator<M>().deallocate(values, size);
+	}
+	template <typename Iterator>
+	void fill(size_t block, Iterator from) {
+		std::uninitialized_copy(std::make_move_iterator(from + begin(block)), std::make_move_iterator(from + end(block)), values + begin(block));
+		filled[block] = 1;
+	}
+	M *data(void) { return values; }
+private:
+	size_t begin(size_t block) const { return std::min(size, block * width); }
+	size_t end(size_t block) const { return std::min(size, (block + 1) * width); }
+
+	M *const values;
+	const size_t size;
+	const size_t width;
+	std::vector<unsigned char> filled;
+};
+
+/* Every worker sorts one block with sortBlock and moves it to a single scratch buffer
+ * allocated once for the whole sort, then the blocks are merged in log2(workers)
+ * parallel rounds, going back and forth between the scratch buffer and the input. */
+template<typename RandomIterator, typename Compare, typename SortBlock>
+void mergeSort(RandomIterator first, RandomIterator last, Compare &comp, SortBlock sortBlock, ThreadCache &cache) {
+	typedef typename std::iterator_traits<RandomIterator>::value_type M;
+	const size_t size = static_cast<size_t>(last - first);
+	const unsigned int nbWorkers = workersFor(size / std::max<size_t>(1, sequentialSortCutoff / 2), cache);
+
+	if (size < sequentialSortCutoff || nbWorkers < 2) {
+		sortBlock(first, last);
+		return ;
+	}
+	const size_t width = (size + nbWorkers - 1) / nbWorkers;
+	sortScratch<M> scratch(size, width, nbWorkers);
+	forEachChunk(nbWorkers, [first, size, width, &sortBlock, &scratch](size_t begin, size_t end) {
+		for (size_t block = begin; block < end; block++) {
+			sortBlock(first + std::min(size, block * width), first + std::min(size, (block + 1) * width));
+			scratch.fill(block, first);
+		}
+	}, cache, schedule::STATIC);
+
+	M *const buffer = scratch.data();
+	bool inScratch = true;
+	for (size_t runWidth = width; runWidth < size; runWidth *= 2) {
+		if (inScratch)
+			mergeRuns(buffer, first, size, runWidth, nbWorkers, comp, cache);
+		else
+			mergeRuns(first, buffer, size, runWidth, nbWorkers, comp, cache);
+		inScratch = !inScratch;
+	}
+	if (inScratch)
+		forEachChunk(size, [first, buffer](size_t begin, size_t end) {
+			std::move(buffer + begin, buffer + end, first + begin);
+		}, cache);
+}
+
+/* Sorts [first, last) with comp using the threads of the cache. Elements only need to be
+ * movable. */
+template<typename RandomIterator, typename Compare>
+void parallelSort(RandomIterator first, RandomIterator last, Compare comp, ThreadCache &cache) {
+	mergeSort(first, last, comp, [&comp](RandomIterator begin, RandomIterator end) { std::sort(begin, end, comp); }, cache);
+}
+
+template<typename RandomIterator>
+void parallelSort(RandomIterator first, RandomIterator last, ThreadCache &cache) {
+	parallelSort(first, last, std::less<typename std::iterator_traits<RandomIterator>::value_type>(), cache);
+}
+
+/* Same as parallelSort, but equal elements keep their relative order. */
+template<typename RandomIterator, typename Compare>
+void parallelStableSort(RandomIterator first, RandomIterator last, Compare comp, ThreadCache &cache) {
+	mergeSort(first, last, comp, [&comp](RandomIterator begin, RandomIterator end) { std::stable_sort(begin, end, comp); }, cache);
+}
+
+template<typename RandomIterator>
+void parallelStableSort(RandomIterator first, RandomIterator last, ThreadCache &cache) {
+	parallelStableSort(first, last, std::less<typename std::iterator_traits<RandomIterator>::value_type>(), cache);
+}
+
+#endif
@@ -0,0 +1,163 @@
+/* Copyright 2016 Laurent Van Begin
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE OpenSSL PROJECT ``AS IS'' AND ANY
+ * EXPRESSED OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE OpenSSL PROJECT OR
+ * ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+  */
+
+#ifndef TASK_GRAPH_H__
+#define TASK_GRAPH_H__
+
+#include <taskGroup.h>
+#include <functional>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <stdexcept>
+
+namespace threadpool {
+
+/* Directed acyclic graph of tasks, declared once and run as many times as needed on a
+ * ForkJoinPool. Each node counts its unfinished predecessors; the worker finishing a
+ * node goes on with one of the successors it made ready and spawns the others, so a
+ * chain of nodes stays on one worker. Running a graph does not allocate. A graph must
+ * not be run by two threads at the same time. */
+class TaskGraph {
+public:
+	TaskGraph(void) : checked(true), pending(0), failed(false) { }
+	TaskGraph(const TaskGraph &) = delete;
+	TaskGraph &operator=(const TaskGraph &) = delete;
+
+	size_t add(std::function<void(void)> f) {
+		nodes.emplace_back(std::move(f));
+		roots.push_back(nodes.size() - 1);
+		return nodes.size() - 1;
+	}
+	/* after only starts when before finished. */
+	void precede(size_t before, size_t after) {
+		if (before >= nodes.size() || after >= nodes.size())
+			throw std::out_of_range("unknown task graph node");
+		nodes[before].successors.push_back(after);
+		if (0 == nodes[after].predecessors++)
+			roots.erase(std::find(roots.begin(), roots.end(), after));
+		checked = false;
+	}
+	size_t size(void) const { return nodes.size(); }
+	/* Runs every node once and returns when all are finished; the calling thread helps
+	 * running them. When a node throws, the nodes not started yet are skipped and the
+	 * first exception is rethrown. */
+	void run(ForkJoinPool &pool) {
+		if (!checked)
+			checkAcyclic();
+		if (nodes.empty())
+			return ;
+		for (auto &n : nodes)
+			n.remaining.store(n.predecessors, std::memory_order_relaxed);
+		failed.store(false, std::memory_order_relaxed);
+		pending.store(nodes.size(), std::memory_order_release);
+		for (size_t root : roots)
+			pool.spawn(task([this, &pool, root]() { runFrom(pool, root); }));
+		pool.helpUntil([this]() { return 0 == pending.load(); });
+		if (nullptr != error)
+			std::rethrow_exception(std::exchange(error, nullptr));
+	}
+private:
+	struct node {
+		explicit node(std::function<void(void)> f) : f(std::move(f)), predecessors(0), remaining(0) { }
+		std::function<void(void)> f;
+		std::vector<size_t> successors;
+		unsigned int predecessors;
+		std::atomic<unsigned int> remaining;
+	};
+
+	void runFrom(ForkJoinPool &pool, size_t current) {
+		for ( ; ; ) {
+			execute(nodes[current]);
+			size_t next = nodes.size();
+			for (size_t successor : nodes[current].successors) {
+				if (1 != nodes[successor].remaining.fetch_sub(1, std::memory_order_acq_rel))
+					continue;
+				if (nodes.size() == next)
+					next = successor;
+				else
+					pool.spawn(task([this, &pool, successor]() { runFrom(pool, successor); }));
+			}
+			/* The last decrement lets run() return and the graph be destroyed: nothing of
+			 * this may be touched after it unless a successor is still to run. */
+			const bool last = nodes.size() == next;
+			if (1 == pending.fetch_sub(1))
+				pool.notifyWaiters();
+			if (last)
+				return ;
+			current = next;
+		}
+	}
+	void execute(node &n) {
+		if (failed.load(std::memory_order_relaxed))
+			return ;
+		try {
+			n.f();
+		}
+		catch (...) {
+			std::lock_guard<std::mutex> lock(mutex);
+			if (nullptr == error)
+				error = std::current_exception();
+			failed.store(true, std::memory_order_relaxed);
+		}
+	}
+	/* Kahn's algorithm: every node must be reachable once all its predecessors are. */
+	void checkAcyclic(void) {
+		std::vector<unsigned int> remaining;
+		std::vector<size_t> ready(roots);
+		size_t visited = 0;
+
+		remaining.reserve(nodes.size());
+		for (const auto &n : nodes)
+			remaining.push_back(n.predecessors);
+		while (!ready.empty()) {
+			const size_t current = ready.back();
+			ready.pop_back();
+			visited++;
+			for (size_t successor : nodes[current].successors)
+				if (0 == --remaining[successor])
+					ready.push_back(successor);
+		}
+		if (visited != nodes.size())
+			throw std::logic_error("task graph has a cycle");
+		checked = true;
+	}
+
+	std::deque<node> nodes;
+	std::vector<size_t> roots;
+	bool checked;
+	std::atomic<size_t> pending;
+	std::atomic<bool> failed;
+	std::mutex mutex;
+	std::exception_ptr error;
+};
+
+}
+
+#endif
@@ -0,0 +1,188 @@
+/* Copyright 2016 Laurent Van Begin
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE OpenSSL PROJECT ``AS IS'' AND ANY
+ * EXPRESSED OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE OpenSSL PROJECT OR
+ * ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+  */
+
+#ifndef TASK_GROUP_H__
+#define TASK_GROUP_H__
+
+#include <threadpool.h>
+#include <executor.h>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <utility>
+
+namespace threadpool {
+
+/* Pool for fork-join parallelism: tasks spawned by a worker go to that worker's own
+ * deque (and are stolen by idle workers), and a worker waiting for its children runs
+ * pending tasks instead of blocking. Spawning never blocks a worker: when its deque and
+ * the shared queue are full, the task runs right away on the spawning thread. A waiter
+ * with nothing to run parks until a task is spawned or notifyWaiters() is called. */
+class ForkJoinPool {
+public:
+	explicit ForkJoinPool(unsigned int poolSize, size_t queueSize, ThreadCache &threadCache) :
+						tasks(queueSize, poolSize), nbThreads(poolSize), nbWaiters(0), workEpoch(0) {
+		tasks.setWaitStrategy(threadCache.getWaitStrategy());
+		threadCache.lease(poolSize, [this]() { run(); });
+	}
+	~ForkJoinPool(void) { nbThreads.terminate(tasks); }
+	void spawn(task t) {
+		if (!tasks.tryPush(t)) {
+			t();
+			return ;
+		}
+		notifyWaiters();
+	}
+	/* Runs pending tasks on the calling thread until done() holds. Whatever makes done()
+	 * hold must call notifyWaiters() afterwards. */
+	template <typename Predicate>
+	void helpUntil(Predicate done) {
+		while (!done()) {
+			if (runPending())
+				continue;
+			std::unique_lock<std::mutex> lock(waitMutex);
+			const uint64_t seen = workEpoch;
+
+			nbWaiters.fetch_add(1);
+			lock.unlock();
+			/* A task spawned before the registration was seen by no notification. */
+			const bool ran = runPending();
+			lock.lock();
+			if (!ran)
+				progress.wait(lock, [&]() { return done() || seen != workEpoch; });
+			nbWaiters.fetch_sub(1);
+		}
+	}
+	/* Wakes up the threads parked in helpUntil(). Only the pool is touched. */
+	void notifyWaiters(void) {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (0 == nbWaiters.load())
+			return ;
+		std::lock_guard<std::mutex> lock(waitMutex);
+		workEpoch++;
+		progress.notify_all();
+	}
+	/* Runs one pending task, if any, on the calling thread. */
+	bool runPending(void) {
+		messageSlot<task> slot;
+
+		if (!tasks.tryPop(slot))
+			return false;
+		slot.take()();
+		return true;
+	}
+private:
+	void run(void) {
+		for ( ; ; ) {
+			try {
+				tasks.pop()();
+			}
+			catch (ThreadSafeQueueEmpty &e) {
+				nbThreads.notifyThreadFinalization();
+				return ;
+			}
+		}
+	}
+	WorkStealingQueue<task> tasks;
+	attachedThreads nbThreads;
+	std::mutex waitMutex;
+	std::condition_variable progress;
+	std::atomic<unsigned int> nbWaiters;
+	uint64_t workEpoch;
+};
+
+/* Set of tasks spawned on a ForkJoinPool that can be waited for together. wait() may be
+ * called from a task of the same pool: the waiting thread helps running pending tasks.
+ * The first exception thrown by a task is rethrown by wait(). */
+class taskGroup {
+public:
+	explicit taskGroup(ForkJoinPool &pool) : pool(pool), pending(0) { }
+	~taskGroup(void) {
+		try {
+			wait();
+		}
+		catch (...) { }
+	}
+	taskGroup(const taskGroup &) = delete;
+	taskGroup &operator=(const taskGroup &) = delete;
+
+	template <typename F>
+	void spawn(F &&f) {
+		pending.fetch_add(1, std::memory_order_relaxed);
+		pool.spawn(task([this, f = std::forward<F>(f)]() mutable {
+			try {
+				f();
+			}
+			catch (...) {
+				std::lock_guard<std::mutex> lock(mutex);
+				if (nullptr == error)
+					error = std::current_exception();
+			}
+			/* The group may be gone once pending reaches 0: only the pool is used then. */
+			ForkJoinPool &p = pool;
+			if (1 == pending.fetch_sub(1))
+				p.notifyWaiters();
+		}));
+	}
+	void wait(void) {
+		pool.helpUntil([this]() { return 0 == pending.load(); });
+		std::lock_guard<std::mutex> lock(mutex);
+		if (nullptr != error)
+			std::rethrow_exception(std::exchange(error, nullptr));
+	}
+private:
+	ForkJoinPool &pool;
+	std::atomic<unsigned int> pending;
+	std::mutex mutex;
+	std::exception_ptr error;
+};
+
+/* Runs every function in parallel (the first one on the calling thread) and waits for all of them. */
+template <typename F, typename... Fs>
+void parallelInvoke(ForkJoinPool &pool, F &&f, Fs&&... fs) {
+	taskGroup group(pool);
+	const int spawned[] = { 0, (group.spawn(std::forward<Fs>(fs)), 0)... };
+
+	(void) spawned;
+	try {
+		f();
+	}
+	catch (...) {
+		try {
+			group.wait();
+		}
+		catch (...) { }
+		throw;
+	}
+	group.wait();
+}
+
+}
+
+#endif
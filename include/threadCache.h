@@ -32,7 +32,16 @@
 
 #include <thread>
 #include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <deque>
 #include <algorithm>
+#include <placement.h>
+#include <waitStrategy.h>
+#include <metrics.h>
 
 namespace threadpool {
 
@@ -41,104 +50,373 @@ typedef std::function<void()> initFunction;
 template <typename M>
 using bodyFunction = std::function<void(M)>;
 
+template <typename M>
+using batchBodyFunction = std::function<void(std::vector<M> &)>;
+
 typedef std::function<void()> finalFunction;
 
 
+/* Cache of threads lent to pools. A cache built with a single size keeps exactly that
+ * many threads. An elastic cache starts minThreads threads, spawns more (up to
+ * maxThreads) when lease() asks for more threads than are idle, and retires threads
+ * idle for longer than idleTimeout, down to minThreads. Threads are pinned according to
+ * the cache placement when they are spawned. The cache waitStrategy is used by idle
+ * threads and by the queues of the pools leasing them. */
 class ThreadCache {
 public:
-	ThreadCache(unsigned int nbThread) : size(nbThread) {
-		const auto registration = [this](Thread *t) {
-			std::lock_guard<std::mutex> lock(mutex);
+	/* Outstanding part of a partial lease: threads coming back to the cache are handed
+	 * to pending leases, oldest first, until they get all their threads or are cancelled. */
+	class PendingLease {
+	public:
+		PendingLease(void) : missing(0), given(0) { }
+	private:
+		friend class ThreadCache;
+		std::function<void ()> threadBody;
+		unsigned int missing;
+		unsigned int given;
+	};
 
-			threads.push_back(std::unique_ptr<Thread>(t));
-			if (threads.size() == size)
-				threadPutBackInCache.notify_one();
-		};
-		for (unsigned int i = 0; i < size; i++)
-			threads.push_back(std::make_unique<Thread>(registration));
+	ThreadCache(unsigned int nbThread, placement policy = placement::none(), waitStrategy strategy = waitStrategy::park()) :
+				ThreadCache(nbThread, nbThread, std::chrono::milliseconds::zero(), std::move(policy), strategy) { }
+	ThreadCache(unsigned int minThreads, unsigned int maxThreads, std::chrono::milliseconds idleTimeout, placement policy = placement::none(),
+				waitStrategy strategy = waitStrategy::park()) :
+				minThreads(minThreads), maxThreads(maxThreads), idleTimeout(idleTimeout), policy(std::move(policy)), strategy(strategy),
+				liveThreads(0), nbSpawned(0), nbRetired(0), nbExiting(0) {
+		if (minThreads > maxThreads)
+			throw std::runtime_error("minimum number of threads greater than maximum");
+		std::lock_guard<std::mutex> lock(mutex);
+		while (liveThreads < minThreads) {
+			threads.push_back(newThread(nbSpawned++));
+			allThreads.push_back(threads.back().get());
+			liveThreads++;
+		}
 	}
 	~ThreadCache(void) {
+		std::vector<std::unique_ptr<Thread>> idle;
 		std::unique_lock<std::mutex> lock(mutex);
 
-		threadPutBackInCache.wait(lock, [this]() { return threads.size() == size; });
+		threadPutBackInCache.wait(lock, [this]() { return threads.size() == liveThreads && 0 == nbExiting; });
+		idle.swap(threads);
+		lock.unlock();
 	}
-	template <typename M>
-	void get(unsigned int nbThreads, initFunction init, bodyFunction<M> body, finalFunction final, ThreadSafeBoundedQueue<M> &queue) {
+	unsigned int getSize(void) const { return maxThreads; }
+	const waitStrategy &getWaitStrategy(void) const { return strategy; }
+	/* Per thread counters are empty unless THREADPOOL_METRICS is defined. */
+	cacheSnapshot metricsSnapshot(void) {
+		std::lock_guard<std::mutex> lock(mutex);
+		cacheSnapshot result;
+
+		result.liveThreads = liveThreads;
+		result.idleThreads = threads.size();
+		result.spawned = nbSpawned;
+		result.retired = nbRetired;
+		for (const Thread *t : allThreads)
+			result.threads.push_back(t->metricsSnapshot());
+		return result;
+	}
+	unsigned int currentSize(void) {
+		std::lock_guard<std::mutex> lock(mutex);
+
+		return liveThreads;
+	}
+	template <typename M, typename Queue>
+	void get(unsigned int nbThreads, initFunction init, bodyFunction<M> body, finalFunction final, Queue &queue) {
+		lease(nbThreads, [i = std::move(init), b = std::move(body), f = std::move(final), &queue]() { Thread::run(i, b, f, &queue); });
+	}
+	template <typename M, typename Queue>
+	void get(unsigned int nbThreads, initFunction init, batchBodyFunction<M> body, size_t maxBatchSize, finalFunction final, Queue &queue) {
+		lease(nbThreads, [i = std::move(init), b = std::move(body), maxBatchSize, f = std::move(final), &queue]() { Thread::runBatch(i, b, maxBatchSize, f, &queue); });
+	}
+	template <typename M, typename Queue>
+	unsigned int getPartially(unsigned int minThreads, unsigned int nbThreads, std::chrono::milliseconds timeout, initFunction init, bodyFunction<M> body,
+						finalFunction final, Queue &queue, PendingLease &pending) {
+		return leasePartially(minThreads, nbThreads, timeout,
+					[i = std::move(init), b = std::move(body), f = std::move(final), &queue]() { Thread::run(i, b, f, &queue); }, pending);
+	}
+	/* Runs threadBody once on nbThreads threads of the cache; every thread comes back
+	 * to the cache when threadBody returns. */
+	void lease(unsigned int nbThreads, const std::function<void ()> &threadBody) {
 		std::unique_lock<std::mutex> lock(mutex);
 
-		if (nbThreads > size)
+		if (nbThreads > maxThreads)
 			throw std::runtime_error("too much threads asked to cache");
-		threadPutBackInCache.wait(lock, [this, nbThreads]() { return threads.size() >= nbThreads; } );
-		std::for_each(threads.end() - nbThreads, threads.end(),
-			[i = std::move(init), b = std::move(body), f = std::move(final), &queue](auto &t){ t->setParameters(i, b, f, queue); t.release(); });
-		threads.erase(threads.end() - nbThreads, threads.end());
+		threadPutBackInCache.wait(lock, [this, nbThreads]() { return threads.size() + maxThreads - liveThreads >= nbThreads; } );
+		reservation leased = reserve(nbThreads);
+		lock.unlock();
+		start(leased, threadBody);
+	}
+	/* Runs threadBody on the threads available now, waiting at most timeout until at
+	 * least minThreads are. Up to nbThreads, the missing threads are given to pending
+	 * as other leases return them. Returns the number of threads started right away. */
+	unsigned int leasePartially(unsigned int minThreads, unsigned int nbThreads, std::chrono::milliseconds timeout,
+					const std::function<void ()> &threadBody, PendingLease &pending) {
+		std::unique_lock<std::mutex> lock(mutex);
+		const auto available = [this]() { return static_cast<unsigned int>(threads.size()) + maxThreads - liveThreads; };
+
+		if (minThreads > nbThreads || nbThreads > maxThreads)
+			throw std::runtime_error("too much threads asked to cache");
+		if (!threadPutBackInCache.wait_for(lock, timeout, [&available, minThreads]() { return available() >= minThreads; }))
+			throw std::runtime_error("not enough threads available in cache");
+		const unsigned int started = std::min(available(), nbThreads);
+		reservation leased = reserve(started);
+		if (started < nbThreads) {
+			pending.threadBody = threadBody;
+			pending.missing = nbThreads - started;
+			pendingLeases.push_back(&pending);
+		}
+		lock.unlock();
+		start(leased, threadBody);
+		return started;
+	}
+	/* Stops handing threads to pending; returns how many threads it received. */
+	unsigned int cancel(PendingLease &pending) {
+		std::lock_guard<std::mutex> lock(mutex);
+
+		pendingLeases.erase(std::remove(pendingLeases.begin(), pendingLeases.end(), &pending), pendingLeases.end());
+		return pending.given;
 	}
 private:
+	class Thread;
+
+	/* Threads taken out of the cache for a lease, and the slots of those to spawn. */
+	struct reservation {
+		std::vector<std::unique_ptr<Thread>> threads;
+		unsigned int firstIndex;
+		unsigned int nbMissing;
+	};
+
+	/* Called with the lock held. Spawning is left to start(), without the lock, so that
+	 * returning threads and other leases are not held up while threads are created. */
+	reservation reserve(unsigned int nbThreads) {
+		const unsigned int fromCache = std::min(static_cast<unsigned int>(threads.size()), nbThreads);
+		reservation leased { std::vector<std::unique_ptr<Thread>>(), nbSpawned, nbThreads - fromCache };
+
+		std::move(threads.end() - fromCache, threads.end(), std::back_inserter(leased.threads));
+		threads.erase(threads.end() - fromCache, threads.end());
+		nbSpawned += leased.nbMissing;
+		liveThreads += leased.nbMissing;
+		return leased;
+	}
+	void start(reservation &leased, const std::function<void ()> &threadBody) {
+		const size_t fromCache = leased.threads.size();
+
+		try {
+			for (unsigned int i = 0; i < leased.nbMissing; i++)
+				leased.threads.push_back(newThread(leased.firstIndex + i));
+		}
+		catch (...) {
+			std::lock_guard<std::mutex> lock(mutex);
+
+			liveThreads -= leased.nbMissing - (leased.threads.size() - fromCache);
+			for (size_t i = fromCache; i < leased.threads.size(); i++)
+				allThreads.push_back(leased.threads[i].get());
+			std::move(leased.threads.begin(), leased.threads.end(), std::back_inserter(threads));
+			threadPutBackInCache.notify_all();
+			throw;
+		}
+		if (0 < leased.nbMissing) {
+			std::lock_guard<std::mutex> lock(mutex);
+
+			for (size_t i = fromCache; i < leased.threads.size(); i++)
+				allThreads.push_back(leased.threads[i].get());
+		}
+		for (auto &t : leased.threads) {
+			t->setParameters(threadBody);
+			t.release();
+		}
+	}
+	std::unique_ptr<Thread> newThread(unsigned int index) {
+		const auto registration = [this](Thread *t) {
+			std::lock_guard<std::mutex> lock(mutex);
+
+			if (!pendingLeases.empty()) {
+				PendingLease *pending = pendingLeases.front();
+				t->setParameters(pending->threadBody);
+				pending->given++;
+				if (0 == --pending->missing)
+					pendingLeases.pop_front();
+				return ;
+			}
+			threads.push_back(std::unique_ptr<Thread>(t));
+			threadPutBackInCache.notify_all();
+		};
+		/* A retired thread is detached and deletes itself on its way out; the destructor
+		 * of the cache waits until it is done. */
+		const auto retirement = [this](Thread *t) {
+			std::lock_guard<std::mutex> lock(mutex);
+
+			const auto idle = std::find_if(threads.begin(), threads.end(), [t](const auto &thread) { return thread.get() == t; });
+			if (liveThreads <= minThreads || threads.end() == idle)
+				return false;
+			allThreads.erase(std::find(allThreads.begin(), allThreads.end(), t));
+			t->detach();
+			idle->release();
+			threads.erase(idle);
+			liveThreads--;
+			nbRetired++;
+			nbExiting++;
+			threadPutBackInCache.notify_all();
+			return true;
+		};
+		const auto exited = [this]() {
+			std::lock_guard<std::mutex> lock(mutex);
+
+			nbExiting--;
+			threadPutBackInCache.notify_all();
+		};
+		return std::make_unique<Thread>(registration, retirement, exited, idleTimeout, strategy, policy.cpusFor(index));
+	}
+
 	class Thread {
 	public:
-		Thread(std::function<void(Thread *)> registration) : state(threadState::NOT_INITIALIZED), mutex(), registration(registration), thread([this]() { cacheThreadBody(); }) {
+		Thread(std::function<void(Thread *)> registration, std::function<bool(Thread *)> retirement, std::function<void()> exited,
+				std::chrono::milliseconds idleTimeout, waitStrategy strategy, std::vector<unsigned int> cpus) :
+					state(threadState::NOT_INITIALIZED), isParked(false), mutex(), registration(registration), retirement(retirement),
+					exited(exited), idleTimeout(idleTimeout), strategy(strategy),
+					thread([this, cpus = std::move(cpus)]() mutable {
+						placeCurrentThread(std::move(cpus));
+						if (cacheThreadBody()) {
+							const std::function<void()> done(this->exited);
+							delete this;
+							done();
+						}
+					}) {
 			std::unique_lock<std::mutex> lock(mutex);
 
 			stateChange.wait(lock, [this]() { return threadState::INITIALIZED == state; });
 		}
 		~Thread(void) {
 			terminateThread();
-			thread.join();
+			if (thread.joinable())
+				thread.join();
 		};
-		template <typename M>
-		void setParameters(initFunction init, bodyFunction<M> body, finalFunction final, ThreadSafeBoundedQueue<M> &queue) {
+		void detach(void) { thread.detach(); }
+		cachedThreadSnapshot metricsSnapshot(void) const { return metrics.snapshot(); }
+		void setParameters(std::function<void ()> body) {
 			std::lock_guard<std::mutex> lock(mutex);
 
-			threadBody = [this, i = std::move(init), b = std::move(body), f = std::move(final), &queue]() { run(*(&i), *(&b), *(&f), &queue); };
-			stateChange.notify_one();
+			threadBody = std::move(body);
+			state.store(threadState::RUNNING, std::memory_order_release);
+			if (isParked)
+				stateChange.notify_one();
+		}
+		template <typename M, typename Queue>
+		static void run(const initFunction &init, const bodyFunction<M> &body, const finalFunction &final, Queue *queue) {
+			init();
+			for ( ; ; ) {
+				try {
+					body(std::move(queue->pop()));
+				}
+				catch (ThreadSafeQueueEmpty &e) {
+					final();
+					return ;
+				}
+			}
+		}
+		template <typename M, typename Queue>
+		static void runBatch(const initFunction &init, const batchBodyFunction<M> &body, size_t maxBatchSize, const finalFunction &final, Queue *queue) {
+			std::vector<M> batch;
+
+			batch.reserve(maxBatchSize);
+			init();
+			for ( ; ; ) {
+				batch.clear();
+				try {
+					queue->popBatch(batch, maxBatchSize);
+				}
+				catch (ThreadSafeQueueEmpty &e) {
+					final();
+					return ;
+				}
+				body(batch);
+			}
 		}
 	private:
-		enum class threadState { NOT_INITIALIZED, INITIALIZED, FINALIZED, };
+		enum class threadState { NOT_INITIALIZED, INITIALIZED, RUNNING, FINALIZED, };
 
 		void terminateThread(void) {
 			std::lock_guard<std::mutex> lock(mutex);
 
-			state = threadState::FINALIZED;
-			stateChange.notify_one();
+			state.store(threadState::FINALIZED, std::memory_order_release);
+			if (isParked)
+				stateChange.notify_one();
 		}
-		void cacheThreadBody(void) {
+		/* Returns true when the thread retired. */
+		bool cacheThreadBody(void) {
 			std::unique_lock<std::mutex> lock(mutex);
 
 			state = threadState::INITIALIZED;
 			stateChange.notify_one();
 			for ( ; ; ) {
-				stateChange.wait(lock);
+				if (!waitForWork(lock)) {
+					lock.unlock();
+					const bool isRetired = retirement(this);
+					lock.lock();
+					if (isRetired)
+						return true;
+					continue;
+				}
 				if (threadState::FINALIZED == state)
-					return ;
+					return false;
+				lock.unlock();
+				metrics.leaseStarted();
 				threadBody();
+				metrics.leaseEnded();
+				lock.lock();
+				state = threadState::INITIALIZED;
+				lock.unlock();
 				registration(this);
+				lock.lock();
 			}
 		}
-		template <typename M>
-		static void run(const initFunction &init, const bodyFunction<M> &body, const finalFunction &final, ThreadSafeBoundedQueue<M> *queue) {
-			init();
-			for ( ; ; ) {
-				try {
-					body(std::move(queue->pop()));
-				}
-				catch (ThreadSafeQueueEmpty &e) {
-					final();
-					return ;
-				}
+		/* The state is only written under the lock, but is polled without it while spinning. */
+		bool waitForWork(std::unique_lock<std::mutex> &lock) {
+			const auto hasWork = [this]() { return threadState::INITIALIZED != state.load(std::memory_order_acquire); };
+			bool found;
+
+			lock.unlock();
+			found = strategy.spin(hasWork);
+			lock.lock();
+			if (found || hasWork())
+				return true;
+			isParked = true;
+			if (std::chrono::milliseconds::zero() == idleTimeout) {
+				stateChange.wait(lock, hasWork);
+				found = true;
 			}
+			else
+				found = stateChange.wait_for(lock, idleTimeout, hasWork);
+			isParked = false;
+			return found;
 		}
 		std::condition_variable stateChange;
-		threadState state;
+		std::atomic<threadState> state;
+		bool isParked;
 		std::mutex mutex;
 		const std::function<void(Thread *)> registration;
-		std::thread thread;
+		const std::function<bool(Thread *)> retirement;
+		const std::function<void()> exited;
+		const std::chrono::milliseconds idleTimeout;
+		const waitStrategy strategy;
+		cachedThreadMetrics metrics;
 		std::function<void ()> threadBody;
+		std::thread thread;
 	};
 
 	std::mutex mutex;
 	std::condition_variable threadPutBackInCache;
-	const unsigned int size;
+	const unsigned int minThreads;
+	const unsigned int maxThreads;
+	const std::chrono::milliseconds idleTimeout;
+	const placement policy;
+	const waitStrategy strategy;
+	unsigned int liveThreads;
+	unsigned int nbSpawned;
+	unsigned int nbRetired;
+	unsigned int nbExiting;
 	std::vector<std::unique_ptr<Thread>> threads;
+	std::vector<Thread *> allThreads;
+	std::deque<PendingLease *> pendingLeases;
 };
 
 }
@@ -32,47 +32,384 @@
 
 #include <queue.h>
 #include <threadCache.h>
+#include <metrics.h>
 
 namespace threadpool {
 
-template <typename M>
+/* Queues whose layout depends on the number of workers (e.g. one deque per worker)
+ * are also given the pool size. */
+template <typename Q, bool = std::is_constructible<Q, size_t, unsigned int>::value>
+struct poolQueue : public Q {
+	poolQueue(size_t waitingQueueSize, unsigned int poolSize) : Q(waitingQueueSize, poolSize) { }
+};
+
+template <typename Q>
+struct poolQueue<Q, false> : public Q {
+	poolQueue(size_t waitingQueueSize, unsigned int) : Q(waitingQueueSize) { }
+};
+
+/* Counts the threads working for a pool: terminate() closes the queue and waits until
+ * every thread has run its final function. */
+class attachedThreads {
+public:
+	explicit attachedThreads(unsigned int nbThreads) : nbThreads(nbThreads) { }
+	void attach(unsigned int nbNewThreads) {
+		std::lock_guard<std::mutex> lock(mutex);
+
+		nbThreads += nbNewThreads;
+	}
+	template <typename Queue>
+	void terminate(Queue &queue) {
+		std::unique_lock<std::mutex> lock(mutex);
+
+		queue.terminate();
+		allMessageTreated.wait(lock, [this]() { return (0 == nbThreads); });
+	}
+	void notifyThreadFinalization() {
+		std::unique_lock<std::mutex> lock(mutex);
+
+		nbThreads --;
+		if (0 == nbThreads)
+			allMessageTreated.notify_one();
+	}
+private:
+	std::mutex mutex;
+	std::condition_variable allMessageTreated;
+	int nbThreads;
+};
+
+/* What add() does when the queue of a pool is full: wait for room, give up, discard
+ * the oldest queued message, or run the message on the calling thread. */
+enum class overflowPolicy { BLOCK, REJECT, DROP_OLDEST, CALLER_RUNS, };
+
+struct overflowCounters {
+	uint64_t rejected;
+	uint64_t dropped;
+	uint64_t runByCaller;
+};
+
+/* When TrackCompletion holds, the pool counts the messages still to be processed, which
+ * wait(), idle() and quiescentEpoch() need. Other pools do not pay for the counting. */
+template <typename M, template <typename> class Queue = ThreadSafeBoundedQueue, bool TrackCompletion = false>
 class Threadpool {
 public:
 	explicit Threadpool(initFunction init, bodyFunction<M> body, finalFunction final, unsigned int poolSize, size_t waitingQueueSize) :
-						cache(new ThreadCache(poolSize)), pendingMessages(waitingQueueSize), nbThreads(poolSize) {
+						cache(new ThreadCache(poolSize)), pendingMessages(waitingQueueSize, poolSize), nbThreads(poolSize) {
 		initializeThreads(init, body, final, poolSize, *cache);
 	}
 	explicit Threadpool(initFunction init, bodyFunction<M> body, finalFunction final, unsigned int poolSize, size_t waitingQueueSize, ThreadCache &threadCache) :
-								cache(), pendingMessages(waitingQueueSize), nbThreads(poolSize) {
+								cache(), pendingMessages(waitingQueueSize, poolSize), nbThreads(poolSize) {
 		initializeThreads(init, body, final, poolSize, threadCache);
 	}
+	explicit Threadpool(initFunction init, batchBodyFunction<M> body, finalFunction final, unsigned int poolSize, size_t waitingQueueSize, size_t maxBatchSize) :
+						cache(new ThreadCache(poolSize)), pendingMessages(waitingQueueSize, poolSize), nbThreads(poolSize) {
+		initializeThreads(init, body, maxBatchSize, final, poolSize, *cache);
+	}
+	explicit Threadpool(initFunction init, batchBodyFunction<M> body, finalFunction final, unsigned int poolSize, size_t waitingQueueSize, size_t maxBatchSize, ThreadCache &threadCache) :
+								cache(), pendingMessages(waitingQueueSize, poolSize), nbThreads(poolSize) {
+		initializeThreads(init, body, maxBatchSize, final, poolSize, threadCache);
+	}
+	/* Starts right away with the threads available in the cache (waiting at most
+	 * minWait until minPoolSize of them are) and takes the threads other pools give
+	 * back to the cache until it runs poolSize threads. */
+	explicit Threadpool(initFunction init, bodyFunction<M> body, finalFunction final, unsigned int minPoolSize, unsigned int poolSize, size_t waitingQueueSize,
+						ThreadCache &threadCache, std::chrono::milliseconds minWait) :
+						cache(), pendingMessages(waitingQueueSize, poolSize), nbThreads(0), partialCache(&threadCache) {
+		auto termination = [this, f = std::move(final)]() { f(); nbThreads.notifyThreadFinalization(); };
+		pendingMessages.setWaitStrategy(threadCache.getWaitStrategy());
+		watchDrops(pendingMessages, 0);
+		setCallerBody(body);
+		nbThreads.attach(threadCache.getPartially(minPoolSize, poolSize, minWait, instrumentInit(std::move(init)), instrumentBody(std::move(body)), termination,
+								pendingMessages, pendingThreads));
+	}
 	~Threadpool() {
-		std::unique_lock<std::mutex> lock(mutex);
+		if (nullptr != partialCache)
+			nbThreads.attach(partialCache->cancel(pendingThreads));
+		nbThreads.terminate(pendingMessages);
+	}
+	/* Adds message according to the overflow policy; returns false if it was rejected. */
+	bool add(M message) { return addWithPolicy(std::move(message)); }
+	/* Adds a message with a priority or a deadline, for the queues ordering messages. The
+	 * overflow policy applies as for add(message). */
+	template <typename Key>
+	bool add(M message, Key key) { return addWithPolicy(std::move(message), key); }
+	/* Adds message only if the queue has room, whatever the overflow policy. */
+	bool tryAdd(M message) { return addFor(std::move(message), std::chrono::nanoseconds::zero()); }
+	template <typename Rep, typename Period>
+	bool addFor(M message, const std::chrono::duration<Rep, Period> &timeout) {
+		const auto start = metrics.addStarted();
+		queuedMessage queued(std::move(message));
+		submission counted(*this, 1);
 
-		pendingMessages.terminate();
-		allMessageTreated.wait(lock, [this]() { return (0 == nbThreads); });
+		if (!pendingMessages.pushFor(queued, timeout))
+			return reject();
+		counted.queued();
+		metrics.addEnded(start);
+		return true;
 	}
-	void add(M message) { pendingMessages.push(std::move(message)); }
+	void setOverflowPolicy(overflowPolicy policy) { overflow.store(policy, std::memory_order_relaxed); }
+	overflowCounters overflowStatistics(void) const {
+		return overflowCounters { nbRejected.load(std::memory_order_relaxed), nbDropped.load(std::memory_order_relaxed),
+						nbRunByCaller.load(std::memory_order_relaxed) };
+	}
+	template <typename Iterator>
+	void addBatch(Iterator first, Iterator last) {
+		const auto start = metrics.addStarted();
+		submission counted(*this, static_cast<size_t>(std::distance(first, last)));
+
+		pendingMessages.pushBatch(first, last);
+		counted.queued();
+		metrics.addEnded(start, poolMetrics::count(first, last));
+	}
+	/* Returns once every message added before or during the call was processed. The
+	 * threads stay attached to the pool, so it can be fed the next batch of messages
+	 * right away. Messages discarded by the queue count as processed. */
+	void wait(void) {
+		static_assert(TrackCompletion, "wait() needs a Threadpool tracking completion");
+		std::unique_lock<std::mutex> lock(idleMutex);
+		becameIdle.wait(lock, [this]() { return idle(); });
+	}
+	bool idle(void) const {
+		static_assert(TrackCompletion, "idle() needs a Threadpool tracking completion");
+		return 0 == outstanding.load(std::memory_order_acquire);
+	}
+	/* Number of times the pool became idle. Once it moved past a value read earlier,
+	 * every message added before that read was processed. */
+	uint64_t quiescentEpoch(void) const {
+		static_assert(TrackCompletion, "quiescentEpoch() needs a Threadpool tracking completion");
+		return epoch.load(std::memory_order_acquire);
+	}
+	/* Counters of the pool; empty unless THREADPOOL_METRICS is defined. */
+	poolSnapshot metricsSnapshot(void) { return metrics.snapshot(); }
+	void startTrace(std::chrono::microseconds window) { metrics.startTrace(window); }
+	void writeChromeTrace(std::ostream &output) { metrics.writeChromeTrace(output); }
 private:
+	typedef poolMetrics::queued<M> queuedMessage;
+
+	template <typename... Key>
+	bool addWithPolicy(M message, const Key&... key) {
+		const auto start = metrics.addStarted();
+		queuedMessage queued(std::move(message));
+		submission counted(*this, 1);
+		size_t evicted;
+
+		switch (overflow.load(std::memory_order_relaxed)) {
+		case overflowPolicy::REJECT:
+			if (!pendingMessages.tryPush(queued, key...))
+				return reject();
+			break;
+		case overflowPolicy::DROP_OLDEST:
+			evicted = pendingMessages.pushEvictingOldest(std::move(queued), key...);
+			nbDropped.fetch_add(evicted, std::memory_order_relaxed);
+			processed(evicted);
+			break;
+		case overflowPolicy::CALLER_RUNS:
+			if (!pendingMessages.tryPush(queued, key...)) {
+				nbRunByCaller.fetch_add(1, std::memory_order_relaxed);
+				callerBody(std::move(poolMetrics::messageOf(queued)));
+				return true;
+			}
+			break;
+		default:
+			pendingMessages.push(std::move(queued), key...);
+		}
+		counted.queued();
+		metrics.addEnded(start);
+		return true;
+	}
+	bool reject(void) {
+		nbRejected.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+	/* Messages counted as submitted until they are queued: when they are rejected, run
+	 * by the caller or the push throws, they are counted as processed on the way out.
+	 * A batch push only throws once the pool is terminated, when nobody can wait for it
+	 * any more, so the messages of a batch that did get in are not told apart. */
+	class submission {
+	public:
+		submission(Threadpool &pool, size_t nbMessages) : pool(pool), nbMessages(nbMessages) { pool.submitted(nbMessages); }
+		~submission(void) { pool.processed(nbMessages); }
+		submission(const submission &) = delete;
+		submission &operator=(const submission &) = delete;
+		void queued(void) { nbMessages = 0; }
+	private:
+		Threadpool &pool;
+		size_t nbMessages;
+	};
+	/* Messages are counted before they are queued, so that a worker never sees the count
+	 * of pending messages going down to 0 while some are still to be processed. */
+	void submitted(size_t nbMessages) {
+		if (TrackCompletion)
+			outstanding.fetch_add(nbMessages, std::memory_order_relaxed);
+	}
+	void processed(size_t nbMessages) {
+		if (!TrackCompletion || 0 == nbMessages || nbMessages != outstanding.fetch_sub(nbMessages, std::memory_order_acq_rel))
+			return ;
+		std::lock_guard<std::mutex> lock(idleMutex);
+		epoch.fetch_add(1, std::memory_order_release);
+		becameIdle.notify_all();
+	}
+	/* Messages expired in a deadline queue never reach a worker: the queue reports them. */
+	template <typename Q>
+	auto watchDrops(Q &queue, int) -> decltype(queue.setDropHandler(nullptr)) {
+		if (TrackCompletion)
+			queue.setDropHandler([this](size_t nbMessages) { processed(nbMessages); });
+	}
+	template <typename Q>
+	void watchDrops(Q &, long) { }
+	void setCallerBody(const bodyFunction<M> &body) { callerBody = body; }
+	void setCallerBody(const batchBodyFunction<M> &body) {
+		callerBody = [body](M message) {
+			std::vector<M> batch;
+			batch.push_back(std::move(message));
+			body(batch);
+		};
+	}
+
+#ifdef THREADPOOL_METRICS
+	initFunction instrumentInit(initFunction init) { return [this, init]() { metrics.attachWorker(); init(); }; }
+	bodyFunction<queuedMessage> instrumentBody(bodyFunction<M> body) {
+		return [this, body](queuedMessage message) {
+			const auto start = metrics.messageStarted(message);
+			body(std::move(message.message));
+			metrics.messageEnded(start);
+			processed(1);
+		};
+	}
+	batchBodyFunction<queuedMessage> instrumentBody(batchBodyFunction<M> body) {
+		return [this, body](std::vector<queuedMessage> &messages) {
+			std::vector<M> batch;
+			metricsClock::time_point start;
+
+			batch.reserve(messages.size());
+			for (auto &message : messages) {
+				start = metrics.messageStarted(message);
+				batch.push_back(std::move(message.message));
+			}
+			body(batch);
+			metrics.messageEnded(start, messages.size());
+			processed(messages.size());
+		};
+	}
+#else
+	static initFunction instrumentInit(initFunction init) { return init; }
+	bodyFunction<M> instrumentBody(bodyFunction<M> body) {
+		if (!TrackCompletion)
+			return body;
+		return [this, body](M message) {
+			body(std::move(message));
+			processed(1);
+		};
+	}
+	batchBodyFunction<M> instrumentBody(batchBodyFunction<M> body) {
+		if (!TrackCompletion)
+			return body;
+		return [this, body](std::vector<M> &messages) {
+			const size_t nbMessages = messages.size();
+			body(messages);
+			processed(nbMessages);
+		};
+	}
+#endif
 	void initializeThreads(initFunction init, bodyFunction<M> body, finalFunction final, unsigned int poolSize, ThreadCache &cache) {
-		auto termination = [this, f = std::move(final)]() { f(); notifyThreadFinalization(); };
-		cache.get(poolSize, init, body, termination, pendingMessages);
+		auto termination = [this, f = std::move(final)]() { f(); nbThreads.notifyThreadFinalization(); };
+		pendingMessages.setWaitStrategy(cache.getWaitStrategy());
+		watchDrops(pendingMessages, 0);
+		setCallerBody(body);
+		cache.get(poolSize, instrumentInit(std::move(init)), instrumentBody(std::move(body)), termination, pendingMessages);
 
 	}
-	void notifyThreadFinalization() {
-		std::unique_lock<std::mutex> lock(mutex);
+	void initializeThreads(initFunction init, batchBodyFunction<M> body, size_t maxBatchSize, finalFunction final, unsigned int poolSize, ThreadCache &cache) {
+		auto termination = [this, f = std::move(final)]() { f(); nbThreads.notifyThreadFinalization(); };
+		pendingMessages.setWaitStrategy(cache.getWaitStrategy());
+		watchDrops(pendingMessages, 0);
+		setCallerBody(body);
+		cache.get(poolSize, instrumentInit(std::move(init)), instrumentBody(std::move(body)), maxBatchSize, termination, pendingMessages);
+	}
+	std::unique_ptr<ThreadCache> cache;
+	poolQueue<Queue<queuedMessage>> pendingMessages;
+	attachedThreads nbThreads;
+	poolMetrics metrics;
+	std::atomic<overflowPolicy> overflow { overflowPolicy::BLOCK };
+	bodyFunction<M> callerBody;
+	std::atomic<uint64_t> nbRejected { 0 };
+	std::atomic<uint64_t> nbDropped { 0 };
+	std::atomic<uint64_t> nbRunByCaller { 0 };
+	std::atomic<size_t> outstanding { 0 };
+	std::atomic<uint64_t> epoch { 0 };
+	std::mutex idleMutex;
+	std::condition_variable becameIdle;
+	ThreadCache *partialCache = nullptr;
+	ThreadCache::PendingLease pendingThreads;
+};
 
-		nbThreads --;
-		if (0 == nbThreads)
-			allMessageTreated.notify_one();
+/* Threadpool whose init, body and final functions are template parameters: the worker
+ * loop is instantiated for them, so small bodies are inlined in the pop loop instead
+ * of going through std::function for every message. Every thread uses its own copy of
+ * the body. */
+template <typename M, typename Body, typename Init = initFunction, typename Final = finalFunction, template <typename> class Queue = ThreadSafeBoundedQueue>
+class StaticThreadpool {
+public:
+	explicit StaticThreadpool(Init init, Body body, Final final, unsigned int poolSize, size_t waitingQueueSize) :
+						cache(new ThreadCache(poolSize)), init(std::move(init)), body(std::move(body)), final(std::move(final)),
+						pendingMessages(waitingQueueSize, poolSize), nbThreads(poolSize) {
+		pendingMessages.setWaitStrategy(cache->getWaitStrategy());
+		cache->lease(poolSize, [this]() { run(); });
+	}
+	explicit StaticThreadpool(Init init, Body body, Final final, unsigned int poolSize, size_t waitingQueueSize, ThreadCache &threadCache) :
+						cache(), init(std::move(init)), body(std::move(body)), final(std::move(final)),
+						pendingMessages(waitingQueueSize, poolSize), nbThreads(poolSize) {
+		pendingMessages.setWaitStrategy(threadCache.getWaitStrategy());
+		threadCache.lease(poolSize, [this]() { run(); });
+	}
+	~StaticThreadpool() { nbThreads.terminate(pendingMessages); }
+	void add(M message) { pendingMessages.push(std::move(message)); }
+	template <typename Iterator>
+	void addBatch(Iterator first, Iterator last) { pendingMessages.pushBatch(first, last); }
+private:
+	void run(void) {
+		Body localBody(body);
+
+		init();
+		for ( ; ; ) {
+			try {
+				localBody(pendingMessages.pop());
+			}
+			catch (ThreadSafeQueueEmpty &e) {
+				final();
+				nbThreads.notifyThreadFinalization();
+				return ;
+			}
+		}
 	}
-	std::mutex mutex;
-	std::condition_variable allMessageTreated;
 	std::unique_ptr<ThreadCache> cache;
-	ThreadSafeBoundedQueue<M> pendingMessages;
-	unsigned int nbThreads;
+	Init init;
+	const Body body;
+	Final final;
+	poolQueue<Queue<M>> pendingMessages;
+	attachedThreads nbThreads;
 };
 
+template <typename M, template <typename> class Queue = ThreadSafeBoundedQueue, typename Init, typename Body, typename Final>
+std::unique_ptr<StaticThreadpool<M, Body, Init, Final, Queue>> makeStaticThreadpool(Init init, Body body, Final final, unsigned int poolSize, size_t waitingQueueSize, ThreadCache &cache) {
+	return std::make_unique<StaticThreadpool<M, Body, Init, Final, Queue>>(std::move(init), std::move(body), std::move(final), poolSize, waitingQueueSize, cache);
+}
+
+/* Builds a threadpool on NUMA node: the pool is constructed from a thread of that node,
+ * so ring-based queues (their cells are initialized on construction) are allocated
+ * there, and the cache threads run on the node's CPUs while they work for the pool.
+ * ThreadSafeBoundedQueue allocates on the producers' threads instead, hence it is refused. */
+template <typename M, template <typename> class Queue = LockFreeBoundedQueue>
+std::unique_ptr<Threadpool<M, Queue>> makeThreadpoolOnNode(unsigned int node, initFunction init, bodyFunction<M> body, finalFunction final,
+							unsigned int poolSize, size_t waitingQueueSize, ThreadCache &cache) {
+	static_assert(!std::is_same<Queue<M>, ThreadSafeBoundedQueue<M>>::value, "a pool on a node needs a queue allocated on construction");
+	const placement onNode = placement::node(node);
+	return runOn(onNode, [&]() {
+		return std::make_unique<Threadpool<M, Queue>>([onNode, init]() { pinCurrentThread(onNode.cpusFor(0)); init(); }, body,
+								[final]() { final(); restoreCurrentThread(); }, poolSize, waitingQueueSize, cache);
+	});
+}
+
 static const std::function<void ()> doNothing = []() { };
 
 }
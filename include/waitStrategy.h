@@ -0,0 +1,130 @@
+/* Copyright 2016 Laurent Van Begin
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE OpenSSL PROJECT ``AS IS'' AND ANY
+ * EXPRESSED OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE OpenSSL PROJECT OR
+ * ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+  */
+
+#ifndef WAIT_STRATEGY_H__
+#define WAIT_STRATEGY_H__
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+
+namespace threadpool {
+
+/* Hint to the CPU that the caller is busy waiting. */
+static inline void cpuRelax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+	asm volatile("yield");
+#else
+	std::atomic_signal_fence(std::memory_order_seq_cst);
+#endif
+}
+
+/* What a thread does before going to sleep when it runs out of work: poll spinIterations
+ * times with a pause instruction, then yieldIterations times yielding the CPU, and only
+ * then park. The default parks right away; spinning trades CPU time for wake-up latency. */
+class waitStrategy {
+public:
+	explicit waitStrategy(unsigned int spinIterations = 0, unsigned int yieldIterations = 0) :
+					spinIterations(spinIterations), yieldIterations(yieldIterations) { }
+	static waitStrategy park(void) { return waitStrategy(); }
+	static waitStrategy spinThenPark(unsigned int spinIterations = 4000, unsigned int yieldIterations = 64) {
+		return waitStrategy(spinIterations, yieldIterations);
+	}
+	/* Polls ready() according to the strategy; false means the caller has to park. */
+	template <typename Predicate>
+	bool spin(Predicate ready) const {
+		for (unsigned int i = 0; i < spinIterations; i++) {
+			if (ready())
+				return true;
+			cpuRelax();
+		}
+		for (unsigned int i = 0; i < yieldIterations; i++) {
+			if (ready())
+				return true;
+			std::this_thread::yield();
+		}
+		return false;
+	}
+private:
+	unsigned int spinIterations;
+	unsigned int yieldIterations;
+};
+
+/* Eventcount: a waiter registers itself before checking its condition a last time under
+ * the lock, so notifiers can skip the lock and the futex call when nobody is parked.
+ * Notifiers must make the condition true before calling notify. */
+class eventCount {
+public:
+	eventCount(void) : waiters(0) { }
+	template <typename Predicate>
+	void wait(Predicate ready) {
+		std::unique_lock<std::mutex> lock(mutex);
+
+		waiters.fetch_add(1);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		condition.wait(lock, ready);
+		waiters.fetch_sub(1);
+	}
+	/* Same as wait(), but gives up at deadline; returns ready(). */
+	template <typename Predicate, typename Clock, typename Duration>
+	bool waitUntil(Predicate ready, const std::chrono::time_point<Clock, Duration> &deadline) {
+		std::unique_lock<std::mutex> lock(mutex);
+
+		waiters.fetch_add(1);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		const bool isReady = condition.wait_until(lock, deadline, ready);
+		waiters.fetch_sub(1);
+		return isReady;
+	}
+	void notifyOne(void) { notify(false); }
+	void notifyAll(void) { notify(true); }
+private:
+	void notify(bool everybody) {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (0 == waiters.load(std::memory_order_relaxed))
+			return ;
+		std::lock_guard<std::mutex> lock(mutex);
+		if (everybody)
+			condition.notify_all();
+		else
+			condition.notify_one();
+	}
+
+	std::atomic<unsigned int> waiters;
+	std::mutex mutex;
+	std::condition_variable condition;
+};
+
+}
+
+#endif
@@ -0,0 +1,251 @@
+/* Copyright 2016 Laurent Van Begin
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE OpenSSL PROJECT ``AS IS'' AND ANY
+ * EXPRESSED OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE OpenSSL PROJECT OR
+ * ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+  */
+
+#ifndef WORKER_CONTEXT_H__
+#define WORKER_CONTEXT_H__
+
+#include <threadpool.h>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <mutex>
+
+namespace threadpool {
+
+/* Bump allocator owned by one worker. Allocating moves a pointer forward in the current
+ * block; reset() makes all the memory available again without giving it back, so a
+ * worker stops allocating once its blocks cover its largest batch. Destructors of the
+ * objects stored in the arena are never called. */
+class workerArena {
+public:
+	explicit workerArena(size_t blockSize = 64 * 1024) : blockSize(blockSize), current(0), used(0) { }
+	workerArena(const workerArena &) = delete;
+	workerArena &operator=(const workerArena &) = delete;
+
+	void *allocate(size_t size, size_t alignment = alignof(std::max_align_t)) {
+		if (!blocks.empty()) {
+			unsigned char *base = blocks[current].memory.get();
+			const uintptr_t address = (reinterpret_cast<uintptr_t>(base + used) + alignment - 1) & ~static_cast<uintptr_t>(alignment - 1);
+			const size_t offset = address - reinterpret_cast<uintptr_t>(base);
+			if (offset + size <= blocks[current].size) {
+				used = offset + size;
+				return base + offset;
+			}
+		}
+		nextBlock(size + alignment);
+		return allocate(size, alignment);
+	}
+	template <typename T, typename... Args>
+	T *create(Args&&... args) {
+		static_assert(std::is_trivially_destructible<T>::value, "objects in a worker arena are never destroyed");
+		return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+	}
+	void reset(void) {
+		current = 0;
+		used = 0;
+	}
+	size_t capacity(void) const {
+		size_t total = 0;
+		for (const auto &b : blocks)
+			total += b.size;
+		return total;
+	}
+private:
+	struct block {
+		std::unique_ptr<unsigned char[]> memory;
+		size_t size;
+	};
+	void nextBlock(size_t minSize) {
+		if (!blocks.empty())
+			current++;
+		while (current < blocks.size() && blocks[current].size < minSize)
+			current++;
+		if (current == blocks.size()) {
+			const size_t size = std::max(blockSize, minSize);
+			blocks.push_back(block { std::unique_ptr<unsigned char[]>(new unsigned char[size]), size });
+		}
+		used = 0;
+	}
+	const size_t blockSize;
+	std::vector<block> blocks;
+	size_t current;
+	size_t used;
+};
+
+/* Standard allocator over a worker arena, e.g. for the scratch containers of a body;
+ * deallocate does nothing, the memory comes back when the arena is reset. */
+template <typename T>
+class arenaAllocator {
+public:
+	typedef T value_type;
+
+	explicit arenaAllocator(workerArena &arena) : arena(&arena) { }
+	template <typename U>
+	arenaAllocator(const arenaAllocator<U> &other) : arena(other.arena) { }
+	T *allocate(size_t n) { return static_cast<T *>(arena->allocate(n * sizeof(T), alignof(T))); }
+	void deallocate(T *, size_t) { }
+	template <typename U>
+	bool operator==(const arenaAllocator<U> &other) const { return arena == other.arena; }
+	template <typename U>
+	bool operator!=(const arenaAllocator<U> &other) const { return arena != other.arena; }
+private:
+	template <typename U>
+	friend class arenaAllocator;
+
+	workerArena *arena;
+};
+
+template <typename M, typename Context, template <typename> class Queue>
+class ContextThreadpool;
+
+/* Messages built by a producer together with their payloads. The producer allocates
+ * the payloads in the arena of the batch; the whole batch is processed by one worker,
+ * after which the arena is reset and kept by the pool for a later makeBatch(). */
+template <typename M>
+class producerBatch {
+public:
+	workerArena &arena(void) { return *memory; }
+	void add(M message) { messages.push_back(std::move(message)); }
+	size_t size(void) const { return messages.size(); }
+private:
+	template <typename, typename, template <typename> class>
+	friend class ContextThreadpool;
+
+	explicit producerBatch(std::unique_ptr<workerArena> memory) : memory(std::move(memory)) { }
+	std::unique_ptr<workerArena> memory;
+	std::vector<M> messages;
+};
+
+template <typename Context>
+using contextInitFunction = std::function<Context(void)>;
+
+template <typename Context, typename M>
+using contextBodyFunction = std::function<void(Context &, workerArena &, M)>;
+
+template <typename Context>
+using contextFinalFunction = std::function<void(Context &)>;
+
+/* Threadpool whose workers own some state: init builds the context of a worker on its
+ * thread, every body call of that worker gets it by reference, and final gets it at
+ * the end. Every worker also has its own arena, reset after each batch of at most
+ * maxBatchSize messages: what a body allocates there must not outlive the batch.
+ * Payloads built by a producer go in the arena of a producerBatch instead. A batch
+ * message needs M to be default constructible. */
+template <typename M, typename Context, template <typename> class Queue = ThreadSafeBoundedQueue>
+class ContextThreadpool {
+public:
+	explicit ContextThreadpool(contextInitFunction<Context> init, contextBodyFunction<Context, M> body, contextFinalFunction<Context> final,
+					unsigned int poolSize, size_t waitingQueueSize, ThreadCache &threadCache, size_t maxBatchSize = 16,
+					size_t arenaBlockSize = 64 * 1024) :
+					init(std::move(init)), body(std::move(body)), final(std::move(final)), maxBatchSize(std::max<size_t>(1, maxBatchSize)),
+					arenaBlockSize(arenaBlockSize), pendingMessages(waitingQueueSize, poolSize), nbThreads(poolSize) {
+		pendingMessages.setWaitStrategy(threadCache.getWaitStrategy());
+		threadCache.lease(poolSize, [this]() { run(); });
+	}
+	~ContextThreadpool() { nbThreads.terminate(pendingMessages); }
+	void add(M message) { pendingMessages.push(envelope(std::move(message))); }
+	template <typename Iterator>
+	void addBatch(Iterator first, Iterator last) {
+		std::vector<envelope> envelopes;
+
+		envelopes.reserve(std::distance(first, last));
+		for ( ; first != last; first++)
+			envelopes.push_back(envelope(*first));
+		pendingMessages.pushBatch(envelopes.begin(), envelopes.end());
+	}
+	/* Returns an empty batch, with an arena recycled from a processed batch if any. */
+	producerBatch<M> makeBatch(void) {
+		std::lock_guard<std::mutex> lock(arenasMutex);
+
+		if (spareArenas.empty())
+			return producerBatch<M>(std::make_unique<workerArena>(arenaBlockSize));
+		producerBatch<M> batch(std::move(spareArenas.back()));
+		spareArenas.pop_back();
+		return batch;
+	}
+	void add(producerBatch<M> batch) { pendingMessages.push(envelope(std::make_unique<producerBatch<M>>(std::move(batch)))); }
+private:
+	/* A message, or a producer batch handed over as a whole. */
+	struct envelope {
+		explicit envelope(M message) : message(std::move(message)) { }
+		explicit envelope(std::unique_ptr<producerBatch<M>> batch) : message(), batch(std::move(batch)) { }
+		M message;
+		std::unique_ptr<producerBatch<M>> batch;
+	};
+
+	void process(Context &context, workerArena &arena, envelope &e) {
+		if (!e.batch) {
+			body(context, arena, std::move(e.message));
+			return ;
+		}
+		for (auto &message : e.batch->messages)
+			body(context, arena, std::move(message));
+		e.batch->memory->reset();
+		std::lock_guard<std::mutex> lock(arenasMutex);
+		spareArenas.push_back(std::move(e.batch->memory));
+	}
+	void run(void) {
+		workerArena arena(arenaBlockSize);
+		Context context(init());
+		std::vector<envelope> batch;
+
+		batch.reserve(maxBatchSize);
+		for ( ; ; ) {
+			batch.clear();
+			try {
+				pendingMessages.popBatch(batch, maxBatchSize);
+			}
+			catch (ThreadSafeQueueEmpty &e) {
+				final(context);
+				nbThreads.notifyThreadFinalization();
+				return ;
+			}
+			for (auto &e : batch)
+				process(context, arena, e);
+			arena.reset();
+		}
+	}
+	const contextInitFunction<Context> init;
+	const contextBodyFunction<Context, M> body;
+	const contextFinalFunction<Context> final;
+	const size_t maxBatchSize;
+	const size_t arenaBlockSize;
+	std::mutex arenasMutex;
+	std::vector<std::unique_ptr<workerArena>> spareArenas;
+	poolQueue<Queue<envelope>> pendingMessages;
+	attachedThreads nbThreads;
+};
+
+}
+
+#endif
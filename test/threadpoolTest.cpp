@@ -29,13 +29,29 @@
 
 #include <iostream>
 #include <atomic>
+#include <deque>
+#include <sstream>
+#include <string>
+#include <numeric>
+#include <iterator>
+#include <algorithm>
+#include <thread>
+#include <chrono>
 #include <assert.h>
 
 #include <threadpool.h>
 #include <threadCache.h>
 
 #include <map.h>
+#include <executor.h>
+#include <taskGroup.h>
+#include <taskGraph.h>
+#include <pipeline.h>
+#include <coroutine.h>
+#include <workerContext.h>
 #include <reduce.h>
+#include <scan.h>
+#include <sort.h>
 
 using namespace threadpool;
 
@@ -108,6 +124,838 @@ static unsigned int executeThreadPool__use_external_thread_cache(void)
         }
 }
 
+static unsigned int executeThreadPool__lock_free_queue(void)
+{
+	std::cout << "Execute threadpool with lock-free queue: ";
+
+	static const std::string message("Hello World");
+	std::atomic<int> messageReceived {0};
+	auto  t = std::make_unique<Threadpool<std::string, LockFreeBoundedQueue>>(doNothing, [&messageReceived](const std::string m) {assert (m == message); messageReceived++;}, doNothing, 5, 64);
+	for (int i = 0; i < nbMessages; i++)
+		t->add(message);
+
+	t.reset(nullptr);
+	if (messageReceived == nbMessages) {
+		std::cout << "OK" << std::endl;
+                return 0;
+        } else {
+		std::cout << "NOK" << std::endl;
+                return 1;
+        }
+}
+
+static unsigned int test_lockFreeQueue_drain_on_terminate(void)
+{
+	std::cout << "Test lock-free queue is drained after termination: ";
+
+	LockFreeBoundedQueue<std::unique_ptr<int>> q(4);
+	for (int i = 0; i < 4; i++)
+		q.push(std::make_unique<int>(i));
+	q.terminate();
+	bool conclusion = true;
+	for (int i = 0; i < 4; i++)
+		conclusion = conclusion && (i == *q.pop());
+	try {
+		q.pop();
+		conclusion = false;
+	}
+	catch (ThreadSafeQueueEmpty &e) { }
+	try {
+		q.push(std::make_unique<int>(0));
+		conclusion = false;
+	}
+	catch (std::runtime_error &e) { }
+	if (conclusion) {
+		std::cout << "OK" << std::endl;
+                return 0;
+	} else {
+		std::cout << "NOK" << std::endl;
+                return 1;
+        }
+}
+
+static unsigned int executeThreadPool__work_stealing(void)
+{
+	std::cout << "Execute threadpool with work stealing: ";
+
+	static const int depth = 12;
+	std::atomic<int> messageReceived {0};
+	Threadpool<int, WorkStealingQueue> *pool = nullptr;
+	auto  t = std::make_unique<Threadpool<int, WorkStealingQueue>>(doNothing, [&messageReceived, &pool](int m) {
+		messageReceived++;
+		if (0 < m) {
+			pool->add(m - 1);
+			pool->add(m - 1);
+		}
+	}, doNothing, 4, 64);
+	pool = t.get();
+	for (int i = 0; i < 10; i++)
+		t->add(depth);
+
+	t.reset(nullptr);
+	if (messageReceived == 10 * ((1 << (depth + 1)) - 1)) {
+		std::cout << "OK" << std::endl;
+                return 0;
+        } else {
+		std::cout << "NOK" << std::endl;
+                return 1;
+        }
+}
+
+static unsigned int executeThreadPool__work_stealing_overflow(void)
+{
+	std::cout << "Execute threadpool with work stealing overflowing a deque while terminating: ";
+
+	std::atomic<int> messageReceived {0};
+	Threadpool<int, WorkStealingQueue> *pool = nullptr;
+	auto  t = std::make_unique<Threadpool<int, WorkStealingQueue>>(doNothing, [&messageReceived, &pool](int m) {
+		messageReceived++;
+		if (0 < m) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			for (int i = 0; i < 200; i++)
+				pool->add(0);
+		}
+	}, doNothing, 2, 16);
+	pool = t.get();
+	t->add(1);
+
+	t.reset(nullptr);
+	if (201 == messageReceived) {
+		std::cout << "OK" << std::endl;
+                return 0;
+        } else {
+		std::cout << "NOK" << std::endl;
+                return 1;
+        }
+}
+
+template <template <typename> class Queue>
+static unsigned int executeThreadPool__batches(const char *queueName)
+{
+	std::cout << "Execute threadpool with batches and " << queueName << ": ";
+
+	static const size_t maxBatchSize = 32;
+	std::atomic<int> messageReceived {0};
+	std::atomic<bool> batchTooLarge {false};
+	std::vector<int> messages(nbMessages, 1);
+	auto  t = std::make_unique<Threadpool<int, Queue>>(doNothing, [&messageReceived, &batchTooLarge](std::vector<int> &batch) {
+		if (maxBatchSize < batch.size())
+			batchTooLarge = true;
+		for (auto m : batch)
+			messageReceived += m;
+	}, doNothing, 5, 1000, maxBatchSize);
+	for (size_t i = 0; i < messages.size(); i += 1000)
+		t->addBatch(messages.begin() + i, messages.begin() + i + 1000);
+
+	t.reset(nullptr);
+	if (messageReceived == nbMessages && !batchTooLarge) {
+		std::cout << "OK" << std::endl;
+                return 0;
+        } else {
+		std::cout << "NOK" << std::endl;
+                return 1;
+        }
+}
+
+static unsigned int executeThreadPool__batches_thread_safe_queue(void) { return executeThreadPool__batches<ThreadSafeBoundedQueue>("thread safe queue"); }
+static unsigned int executeThreadPool__batches_lock_free_queue(void) { return executeThreadPool__batches<LockFreeBoundedQueue>("lock-free queue"); }
+static unsigned int executeThreadPool__batches_work_stealing(void) { return executeThreadPool__batches<WorkStealingQueue>("work stealing"); }
+
+static unsigned int executeStaticThreadPool(void)
+{
+	std::cout << "Execute threadpool with inlined body: ";
+
+	std::atomic<int> messageReceived {0};
+	std::atomic<unsigned int> finalDone {0};
+	ThreadCache cache(5);
+	auto t = makeStaticThreadpool<int, LockFreeBoundedQueue>(doNothing, [&messageReceived](int m) { messageReceived += m; },
+								[&finalDone]() { finalDone++; }, 5, 64, cache);
+	for (int i = 0; i < nbMessages; i++)
+		t->add(1);
+
+	t.reset(nullptr);
+	if (messageReceived == nbMessages && 5 == finalDone) {
+		std::cout << "OK" << std::endl;
+                return 0;
+        } else {
+		std::cout << "NOK" << std::endl;
+                return 1;
+        }
+}
+
+static long parallelFibonacci(ForkJoinPool &pool, int n)
+{
+	if (n < 2)
+		return n;
+	long left = 0, right = 0;
+	parallelInvoke(pool, [&pool, &left, n]() { left = parallelFibonacci(pool, n - 1); },
+				[&pool, &right, n]() { right = parallelFibonacci(pool, n - 2); });
+	return left + right;
+}
+
+static unsigned int test_fork_join(void)
+{
+	std::cout << "Test fork-join task groups: ";
+
+	ThreadCache cache(4);
+	ForkJoinPool pool(4, 8, cache);
+	const long fibonacci = parallelFibonacci(pool, 18);
+
+	std::atomic<int> sum {0};
+	{
+		taskGroup group(pool);
+		for (int i = 1; i <= 100; i++)
+			group.spawn([&sum, i]() { sum += i; });
+		group.wait();
+	}
+	bool caught = false;
+	try {
+		taskGroup group(pool);
+		group.spawn([]() { throw std::runtime_error("child failed"); });
+		group.wait();
+	}
+	catch (std::runtime_error &e) {
+		caught = true;
+	}
+
+	if (2584 == fibonacci && 5050 == sum && caught) {
+		std::cout << "OK" << std::endl;
+                return 0;
+        } else {
+		std::cout << "NOK" << std::endl;
+                return 1;
+        }
+}
+
+static unsigned int test_task_graph_destroyed_after_run(void)
+{
+	std::cout << "Test task graphs destroyed right after running: ";
+
+	ThreadCache cache(4);
+	ForkJoinPool pool(4, 64, cache);
+	std::atomic<int> executed {0};
+	for (int i = 0; i < 500; i++) {
+		TaskGraph graph;
+		const size_t root = graph.add([&executed]() { executed++; });
+		for (int j = 0; j < 8; j++)
+			graph.precede(root, graph.add([&executed]() { executed++; }));
+		graph.run(pool);
+	}
+
+	if (500 * 9 == executed) {
+		std::cout << "OK" << std::endl;
+                return 0;
+        } else {
+		std::cout << "NOK" << std::endl;
+                return 1;
+        }
+}
+
+static unsigned int test_pipeline(void)
+{
+	std::cout << "Test pipeline stages: ";
+
+	ThreadCache cache(4);
+	Pipeline<int> pipeline(cache, 4, 8);
+	std::atomic<int> concurrent {0};
+	std::atomic<int> maxConcurrent {0};
+	int serialCount = 0;
+	std::vector<int> output;
+	pipeline.stage(stageMode::PARALLEL, [&](int &i) {
+			const int now = ++concurrent;
+			int seen = maxConcurrent.load();
+			while (now > seen && !maxConcurrent.compare_exchange_weak(seen, now)) { }
+			i *= i;
+			concurrent--;
+		}, 2)
+		.stage(stageMode::SERIAL_OUT_OF_ORDER, [&serialCount](int &) { serialCount++; })
+		.stage(stageMode::PARALLEL, [](int &i) { i += 1; })
+		.stage(stageMode::SERIAL_IN_ORDER, [&output](int &i) { output.push_back(i); });
+	std::vector<int> input(1000);
+	std::iota(input.begin(), input.end(), 0);
+	pipeline.run(input.begin(), input.end());
+
+	bool inOrder = (1000 == output.size());
+	for (int i = 0; inOrder && i < 1000; i++)
+		inOrder = (i * i + 1 == output[i]);
+
+	Pipeline<int> failing(cache, 2, 4);
+	int reached = 0;
+	failing.stage(stageMode::PARALLEL, [](int &i) { if (3 == i) throw std::runtime_error("stage failed"); })
+		.stage(stageMode::SERIAL_IN_ORDER, [&reached](int &) { reached++; });
+	bool caught = false;
+	try {
+		failing.run(input.begin(), input.begin() + 10);
+	}
+	catch (std::runtime_error &e) {
+		caught = true;
+	}
+
+	if (inOrder && 1000 == serialCount && 2 >= maxConcurrent && caught && 9 == reached) {
+		std::cout << "OK" << std::endl;
+                return 0;
+        } else {
+		std::cout << "NOK" << std::endl;
+                return 1;
+        }
+}
+
+#ifdef THREADPOOL_COROUTINES
+static lazyTask<int> squareOnWorker(CoroutineScheduler &scheduler, int i, std::thread::id caller, std::atomic<int> &onCaller)
+{
+	co_await scheduler.schedule();
+	if (std::this_thread::get_id() == caller)
+		onCaller++;
+	co_return i * i;
+}
+
+static lazyTask<int> sumOfSquares(CoroutineScheduler &scheduler, int n, std::atomic<int> &onCaller)
+{
+	std::vector<lazyTask<int>> tasks;
+	for (int i = 0; i < n; i++)
+		tasks.push_back(squareOnWorker(scheduler, i, std::this_thread::get_id(), onCaller));
+	const std::vector<int> squares = co_await whenAll(std::move(tasks));
+	co_return std::accumulate(squares.begin(), squares.end(), 0);
+}
+
+static lazyTask<void> failOnWorker(CoroutineScheduler &scheduler)
+{
+	co_await scheduler.schedule();
+	throw std::runtime_error("coroutine failed");
+}
+
+static unsigned int test_coroutines(void)
+{
+	std::cout << "Test coroutines on a thread cache: ";
+
+	ThreadCache cache(4);
+	CoroutineScheduler scheduler(4, 256, cache);
+	std::atomic<int> onCaller {0};
+	const int sum = syncWait(sumOfSquares(scheduler, 100, onCaller));
+
+	std::vector<lazyTask<void>> failing;
+	failing.push_back(failOnWorker(scheduler));
+	bool caught = false;
+	try {
+		syncWait(whenAll(std::move(failing)));
+	}
+	catch (std::runtime_error &e) {
+		caught = true;
+	}
+
+	if (328350 == sum && 0 == onCaller && caught) {
+		std::cout << "OK" << std::endl;
+                return 0;
+        } else {
+		std::cout << "NOK" << std::endl;
+                return 1;
+        }
+}
+#endif
+
+static unsigned int test_task_graph(void)
+{
+	std::cout << "Test task graph: ";
+
+	ThreadCache cache(4);
+	ForkJoinPool pool(4, 64, cache);
+	TaskGraph graph;
+	std::atomic<unsigned int> clock {0};
+	std::vector<unsigned int> finished(104);
+	std::vector<size_t> nodes;
+	for (size_t i = 0; i < finished.size(); i++)
+		nodes.push_back(graph.add([&clock, &finished, i]() { finished[i] = ++clock; }));
+	graph.precede(nodes[0], nodes[1]);
+	graph.precede(nodes[0], nodes[2]);
+	graph.precede(nodes[1], nodes[3]);
+	graph.precede(nodes[2], nodes[3]);
+	for (size_t i = 4; i < finished.size(); i++)
+		graph.precede(nodes[i - 1], nodes[i]);
+
+	bool ordered = true;
+	for (int run = 0; run < 3; run++) {
+		clock = 0;
+		graph.run(pool);
+		ordered = ordered && finished[0] < finished[1] && finished[0] < finished[2] &&
+				finished[1] < finished[3] && finished[2] < finished[3];
+		for (size_t i = 4; i < finished.size(); i++)
+			ordered = ordered && finished[i - 1] < finished[i];
+		ordered = ordered && finished.size() == clock;
+	}
+
+	TaskGraph failing;
+	int skipped = 0;
+	const size_t first = failing.add([]() { throw std::runtime_error("node failed"); });
+	failing.precede(first, failing.add([&skipped]() { skipped++; }));
+	bool caught = false;
+	try {
+		failing.run(pool);
+	}
+	catch (std::runtime_error &e) {
+		caught = true;
+	}
+
+	TaskGraph cyclic;
+	const size_t a = cyclic.add([]() { });
+	const size_t b = cyclic.add([]() { });
+	cyclic.precede(a, b);
+	cyclic.precede(b, a);
+	bool cycle = false;
+	try {
+		cyclic.run(pool);
+	}
+	catch (std::logic_error &e) {
+		cycle = true;
+	}
+
+	if (ordered && caught && 0 == skipped && cycle) {
+		std::cout << "OK" << std::endl;
+                return 0;
+        } else {
+		std::cout << "NOK" << std::endl;
+                return 1;
+        }
+}
+
+static unsigned int test_elastic_thread_cache(void)
+{
+	std::cout << "Test elastic thread cache grows and shrinks: ";
+
+	std::atomic<int> messageReceived {0};
+	ThreadCache cache(1, 4, std::chrono::milliseconds(20));
+	const unsigned int initialSize = cache.currentSize();
+	auto  t = std::make_unique<Threadpool<int>>(doNothing, [&messageReceived](int m) { messageReceived += m; }, doNothing, 4, 64, cache);
+	const unsigned int grownSize = cache.currentSize();
+	for (int i = 0; i < 1000; i++)
+		t->add(1);
+	t.reset(nullptr);
+	for (int i = 0; i < 100 && 1 != cache.currentSize(); i++)
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	const unsigned int shrunkSize = cache.currentSize();
+	t = std::make_unique<Threadpool<int>>(doNothing, [&messageReceived](int m) { messageReceived += m; }, doNothing, 3, 64, cache);
+	t->add(1);
+	t.reset(nullptr);
+
+	if (1 == initialSize && 4 == grownSize && 1 == shrunkSize && 1001 == messageReceived) {
+		std::cout << "OK" << std::endl;
+                return 0;
+        } else {
+		std::cout << "NOK" << std::endl;
+                return 1;
+        }
+}
+
+static unsigned int test_partial_thread_acquisition(void)
+{
+	std::cout << "Test threadpool starting with part of its threads: ";
+
+	std::atomic<int> messageReceived {0};
+	std::atomic<int> startedThreads {0};
+	ThreadCache cache(4);
+	auto  busy = std::make_unique<Threadpool<int>>(doNothing, [](int) { }, doNothing, 3, 64, cache);
+	Threadpool<int> t([&startedThreads]() { startedThreads++; }, [&messageReceived](int m) { messageReceived += m; }, doNothing,
+				1, 4, 64, cache, std::chrono::milliseconds(1000));
+	t.add(1);
+	for (int i = 0; i < 100 && 1 != messageReceived; i++)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	const bool startedWithOne = (1 == messageReceived && 1 == startedThreads);
+	busy.reset(nullptr);
+	for (int i = 0; i < 100 && 4 != startedThreads; i++)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	bool timedOut = false;
+	try {
+		Threadpool<int> starved(doNothing, [](int) { }, doNothing, 1, 2, 64, cache, std::chrono::milliseconds(10));
+	}
+	catch (std::runtime_error &e) {
+		timedOut = true;
+	}
+
+	if (startedWithOne && 4 == startedThreads && timedOut) {
+		std::cout << "OK" << std::endl;
+                return 0;
+        } else {
+		std::cout << "NOK" << std::endl;
+                return 1;
+        }
+}
+
+static unsigned int test_thread_placement(void)
+{
+	std::cout << "Test thread placement: ";
+
+	const auto &topology = cpuTopology::get();
+	const bool listParsed = (std::vector<unsigned int> { 0, 1, 2, 3, 8, 10, 11 } == cpuTopology::parseList("0-3,8,10-11"));
+	auto compactOrder = placement::compact().cpusFor(0);
+	auto scatterOrder = placement::scatter().cpusFor(0);
+	const bool singleCpus = (1 == compactOrder.size() && 1 == scatterOrder.size());
+
+	std::atomic<int> pinnedThreads {0};
+	std::atomic<int> messageReceived {0};
+	{
+		ThreadCache cache(4, placement::compact());
+		Threadpool<int> t([&pinnedThreads]() {
+#ifdef __linux__
+					cpu_set_t set;
+					if (0 == pthread_getaffinity_np(pthread_self(), sizeof(set), &set) && 1 == CPU_COUNT(&set))
+						pinnedThreads++;
+#else
+					pinnedThreads++;
+#endif
+				}, [&messageReceived](int m) { messageReceived += m; }, doNothing, 2, 64, cache);
+		auto onNode = makeThreadpoolOnNode<int, LockFreeBoundedQueue>(topology.nodes().front(), doNothing,
+								[&messageReceived](int m) { messageReceived += m; }, doNothing, 2, 64, cache);
+		for (int i = 0; i < 100; i++)
+			onNode->add(1);
+	}
+
+	if (listParsed && !topology.allCpus().empty() && singleCpus && 2 == pinnedThreads && 100 == messageReceived) {
+		std::cout << "OK" << std::endl;
+                return 0;
+        } else {
+		std::cout << "NOK" << std::endl;
+                return 1;
+        }
+}
+
+template <template <typename> class Queue>
+static bool spinningPoolReceivesAll(ThreadCache &cache)
+{
+	std::atomic<int> messageReceived {0};
+	{
+		Threadpool<int, Queue> t(doNothing, [&messageReceived](int m) { messageReceived += m; }, doNothing, 2, 16, cache);
+		for (int i = 0; i < 1000; i++) {
+			t.add(1);
+			if (0 == i % 100)
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+	return 1000 == messageReceived;
+}
+
+static unsigned int test_spin_then_park(void)
+{
+	std::cout << "Test threadpools spinning before parking: ";
+
+	ThreadCache cache(2, placement::none(), waitStrategy::spinThenPark(1000, 10));
+	const bool received = spinningPoolReceivesAll<ThreadSafeBoundedQueue>(cache) && spinningPoolReceivesAll<LockFreeBoundedQueue>(cache) &&
+				spinningPoolReceivesAll<WorkStealingQueue>(cache);
+
+	if (received) {
+		std::cout << "OK" << std::endl;
+                return 0;
+        } else {
+		std::cout << "NOK" << std::endl;
+                return 1;
+        }
+}
+
+/* Holds the single worker on a first message while the others are queued, then returns
+ * the order in which they were received. */
+template <template <typename> class Queue, typename Fill>
+static std::vector<int> receptionOrder(Fill fill, size_t queueSize = 16)
+{
+	std::atomic<bool> started {false};
+	std::atomic<bool> released {false};
+	std::vector<int> order;
+	{
+		Threadpool<int, Queue> t(doNothing, [&started, &released, &order](int m) {
+							if (-1 != m) {
+								order.push_back(m);
+								return ;
+							}
+							started = true;
+							while (!released)
+								std::this_thread::sleep_for(std::chrono::milliseconds(1));
+						}, doNothing, 1, queueSize);
+		t.add(-1);
+		while (!started)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		fill(t);
+		released = true;
+	}
+	return order;
+}
+
+static unsigned int test_priority_and_deadline_queues(void)
+{
+	std::cout << "Test priority and deadline queues: ";
+
+	const auto now = std::chrono::steady_clock::now();
+	const auto byPriority = receptionOrder<PriorityBoundedQueue>([](auto &t) {
+		t.add(1);
+		t.add(2);
+		t.add(3, 4u);
+		t.add(4, 0u);
+		t.add(5, 4u);
+	});
+	const auto byDeadline = receptionOrder<DeadlineBoundedQueue>([now](auto &t) {
+		t.add(1);
+		t.add(2, now + std::chrono::seconds(20));
+		t.add(3, now + std::chrono::seconds(10));
+		t.add(4, now - std::chrono::seconds(1));
+	});
+	const auto notExpired = receptionOrder<ExpiringDeadlineBoundedQueue>([now](auto &t) {
+		t.add(1);
+		t.add(2, now + std::chrono::seconds(20));
+		t.add(3, now - std::chrono::seconds(1));
+	});
+	const auto priorityEvicted = receptionOrder<PriorityBoundedQueue>([](auto &t) {
+		t.setOverflowPolicy(overflowPolicy::DROP_OLDEST);
+		t.add(1, 0u);
+		t.add(2, 7u);
+		t.add(3, 3u);
+	}, 2);
+	const auto deadlineEvicted = receptionOrder<DeadlineBoundedQueue>([now](auto &t) {
+		t.setOverflowPolicy(overflowPolicy::DROP_OLDEST);
+		t.add(1, now + std::chrono::seconds(10));
+		t.add(2, now + std::chrono::seconds(20));
+		t.add(3, now + std::chrono::seconds(5));
+	}, 2);
+	bool keyedRejected = false;
+	const auto priorityRejected = receptionOrder<PriorityBoundedQueue>([&keyedRejected](auto &t) {
+		t.setOverflowPolicy(overflowPolicy::REJECT);
+		t.add(1, 1u);
+		t.add(2, 1u);
+		keyedRejected = !t.add(3, 0u);
+	}, 2);
+
+	if (std::vector<int> { 4, 3, 5, 1, 2 } == byPriority && std::vector<int> { 4, 3, 2, 1 } == byDeadline &&
+	    std::vector<int> { 2, 1 } == notExpired && std::vector<int> { 1, 3 } == priorityEvicted &&
+	    std::vector<int> { 3, 1 } == deadlineEvicted && keyedRejected && std::vector<int> { 1, 2 } == priorityRejected) {
+		std::cout << "OK" << std::endl;
+                return 0;
+        } else {
+		std::cout << "NOK" << std::endl;
+                return 1;
+        }
+}
+
+template <template <typename> class Queue>
+static bool overflowHandled(void)
+{
+	std::atomic<bool> started {false};
+	std::atomic<bool> released {false};
+	std::vector<int> order;
+	overflowCounters counters;
+	bool accepted;
+	{
+		Threadpool<int, Queue> t(doNothing, [&started, &released, &order](int m) {
+							if (-1 != m) {
+								order.push_back(m);
+								return ;
+							}
+							started = true;
+							while (!released)
+								std::this_thread::sleep_for(std::chrono::milliseconds(1));
+						}, doNothing, 1, 2);
+		t.add(-1);
+		while (!started)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		t.add(1);
+		t.add(2);
+		accepted = t.tryAdd(3) || t.addFor(3, std::chrono::milliseconds(10));
+		t.setOverflowPolicy(overflowPolicy::REJECT);
+		accepted = accepted || t.add(4);
+		t.setOverflowPolicy(overflowPolicy::DROP_OLDEST);
+		accepted = accepted || !t.add(5);
+		t.setOverflowPolicy(overflowPolicy::CALLER_RUNS);
+		accepted = accepted || !t.add(6);
+		counters = t.overflowStatistics();
+		released = true;
+	}
+	return !accepted && std::vector<int> { 6, 2, 5 } == order && 3 == counters.rejected && 1 == counters.dropped && 1 == counters.runByCaller;
+}
+
+static unsigned int test_worker_context_and_arena(void)
+{
+	std::cout << "Test worker contexts and arenas: ";
+
+	struct context {
+		std::thread::id owner;
+		int processed;
+		bool sameThread;
+	};
+	ThreadCache cache(4);
+	std::atomic<int> total {0};
+	std::atomic<int> workers {0};
+	std::atomic<bool> correct {true};
+	{
+		ContextThreadpool<int, context> t([]() { return context { std::this_thread::get_id(), 0, true }; },
+			[&correct](context &c, workerArena &arena, int m) {
+				c.sameThread = c.sameThread && std::this_thread::get_id() == c.owner;
+				c.processed++;
+				std::vector<int, arenaAllocator<int>> scratch { arenaAllocator<int>(arena) };
+				for (int i = 0; i < m; i++)
+					scratch.push_back(i);
+				double *aligned = static_cast<double *>(arena.allocate(sizeof(double), 64));
+				if (m != static_cast<int>(scratch.size()) || 0 != reinterpret_cast<uintptr_t>(aligned) % 64)
+					correct = false;
+			},
+			[&total, &workers, &correct](context &c) {
+				total += c.processed;
+				workers++;
+				if (!c.sameThread)
+					correct = false;
+			}, 4, 32, cache, 8, 1024);
+		for (int i = 0; i < 1000; i++)
+			t.add(i % 300);
+	}
+
+	std::atomic<int> payloadSum {0};
+	{
+		ContextThreadpool<const int *, int> t([]() { return 0; },
+			[&payloadSum](int &, workerArena &, const int *payload) { payloadSum += *payload; },
+			[](int &) { }, 2, 8, cache);
+		for (int round = 0; round < 20; round++) {
+			producerBatch<const int *> batch = t.makeBatch();
+			for (int i = 1; i <= 10; i++)
+				batch.add(batch.arena().create<int>(i));
+			t.add(std::move(batch));
+		}
+	}
+
+	workerArena arena(128);
+	arena.allocate(100);
+	arena.allocate(100);
+	const size_t grown = arena.capacity();
+	arena.reset();
+	arena.allocate(100);
+	arena.allocate(100);
+	const bool reused = (grown == arena.capacity());
+
+	if (1000 == total && 4 == workers && correct && reused && 20 * 55 == payloadSum) {
+		std::cout << "OK" << std::endl;
+                return 0;
+        } else {
+		std::cout << "NOK" << std::endl;
+                return 1;
+        }
+}
+
+static unsigned int test_wait_and_reuse(void)
+{
+	std::cout << "Test waiting for a pool to be idle and reusing it: ";
+
+	ThreadCache cache(4);
+	std::atomic<int> processed {0};
+	bool phasesComplete = true;
+	bool epochMoved;
+	{
+		Threadpool<int, ThreadSafeBoundedQueue, true> t(doNothing, [&processed](int i) { processed += i; }, doNothing, 4, 16, cache);
+		const uint64_t firstEpoch = t.quiescentEpoch();
+		for (int phase = 1; phase <= 100; phase++) {
+			for (int i = 0; i < 10; i++)
+				t.add(1);
+			t.wait();
+			phasesComplete = phasesComplete && 10 * phase == processed && t.idle();
+		}
+		epochMoved = t.quiescentEpoch() > firstEpoch;
+	}
+
+	const auto now = std::chrono::steady_clock::now();
+	std::atomic<int> onTime {0};
+	{
+		Threadpool<int, ExpiringDeadlineBoundedQueue, true> expiring(doNothing, [&onTime](int) { onTime++; }, doNothing, 1, 16, cache);
+		expiring.add(1, now - std::chrono::seconds(1));
+		expiring.add(2, now + std::chrono::seconds(60));
+		expiring.wait();
+	}
+
+	const std::thread::id caller = std::this_thread::get_id();
+	std::atomic<bool> started {false};
+	std::atomic<bool> released {false};
+	bool callerFailed = false;
+	{
+		Threadpool<int, ThreadSafeBoundedQueue, true> blocked(doNothing, [caller, &started, &released](int) {
+			if (std::this_thread::get_id() == caller)
+				throw std::runtime_error("caller");
+			started = true;
+			while (!released)
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}, doNothing, 1, 1, cache);
+		blocked.setOverflowPolicy(overflowPolicy::CALLER_RUNS);
+		blocked.add(0);
+		while (!started)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		blocked.add(0);
+		try {
+			blocked.add(0);
+		}
+		catch (std::runtime_error &e) {
+			callerFailed = true;
+		}
+		released = true;
+		blocked.wait();
+	}
+
+	WorkerTeam team(4, cache);
+	std::vector<long> v(1000);
+	std::iota(v.begin(), v.end(), 0);
+	bool teamResults = true;
+	for (int phase = 0; phase < 100; phase++) {
+		map(v.begin(), v.end(), v.begin(), [](long x) { return x + 1; }, team);
+		teamResults = teamResults && (1000 * (999 + 2 * (phase + 1)) / 2 == associativeReduce(v.begin(), v.end(), 0L, [](long a, long b) { return a + b; }, team));
+	}
+
+	if (phasesComplete && epochMoved && 1 == onTime && callerFailed && teamResults) {
+		std::cout << "OK" << std::endl;
+                return 0;
+        } else {
+		std::cout << "NOK" << std::endl;
+                return 1;
+        }
+}
+
+static unsigned int test_overflow_policies(void)
+{
+	std::cout << "Test tryAdd, addFor and overflow policies: ";
+
+	if (overflowHandled<ThreadSafeBoundedQueue>() && overflowHandled<LockFreeBoundedQueue>()) {
+		std::cout << "OK" << std::endl;
+                return 0;
+        } else {
+		std::cout << "NOK" << std::endl;
+                return 1;
+        }
+}
+
+static unsigned int test_metrics(void)
+{
+	std::cout << "Test threadpool and cache metrics: ";
+
+	ThreadCache cache(2);
+	std::stringstream trace;
+	poolSnapshot pool;
+	{
+		Threadpool<int> t(doNothing, [](int) { }, doNothing, 2, 16, cache);
+		t.startTrace(std::chrono::seconds(10));
+		for (int i = 0; i < 100; i++)
+			t.add(i);
+		pool = t.metricsSnapshot();
+		for (int i = 0; i < 100 && metricsEnabled && 100 != pool.processed; i++) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			pool = t.metricsSnapshot();
+		}
+		t.writeChromeTrace(trace);
+	}
+	const cacheSnapshot threads = cache.metricsSnapshot();
+	const bool cacheCounted = (2 == threads.liveThreads && 2 == threads.spawned && 2 == threads.threads.size());
+	bool poolCounted;
+	if (metricsEnabled)
+		poolCounted = (100 == pool.added && 100 == pool.processed && 0 == pool.queueDepth && 100 == pool.queueWait.count &&
+				100 == pool.service.count && 2 == pool.workers.size() && std::string::npos != trace.str().find("\"ph\":\"X\""));
+	else
+		poolCounted = (0 == pool.added && pool.workers.empty() && std::string::npos != trace.str().find("traceEvents"));
+
+	if (cacheCounted && poolCounted) {
+		std::cout << "OK" << std::endl;
+                return 0;
+        } else {
+		std::cout << "NOK" << std::endl;
+                return 1;
+        }
+}
+
 static unsigned int test_map_in_place(void)
 {
 	std::cout << "Test implementation of map in place operator: ";
@@ -181,6 +1029,112 @@ static unsigned int test_map_with_pointers(void)
         }
 }
 
+static unsigned int test_forEach_schedules(void)
+{
+	std::cout << "Test implementation of forEach operator with every schedule: ";
+
+	bool conclusion = true;
+	std::deque<int> v(100000, 0);
+	ThreadCache cache(4);
+	for (auto policy : { schedule::STATIC, schedule::DYNAMIC, schedule::GUIDED })
+		forEach(v.begin(), v.end(), [](int &i) { i++; }, cache, policy, 1000);
+	forEach(v.begin(), v.begin() + 3, [](int &i) { i++; }, cache);
+
+	for (size_t i = 0; i < v.size(); i++)
+		if  ((i < 3 ? 4 : 3) != v[i]) {
+			std::cout << "i = " << i << ", v[i] = " << v[i] << std::endl;
+			conclusion = false;
+			break;
+		}
+	if (conclusion) {
+		std::cout << "OK" << std::endl;
+                return 0;
+	} else {
+		std::cout << "NOK" << std::endl;
+                return 1;
+        }
+}
+
+static unsigned int test_map_range(void)
+{
+	std::cout << "Test implementation of map operator on a range: ";
+
+	bool conclusion = true;
+	std::vector<int> v(100000);
+	std::vector<double> output(v.size());
+	ThreadCache cache(4);
+	for (size_t i = 0; i < v.size(); i++)
+		v[i] = i;
+	map(v.cbegin(), v.cend(), output.begin(), [](int i) { return i / 2.0; }, cache, schedule::GUIDED);
+
+	for (size_t i = 0; i < output.size(); i++)
+		if  (i / 2.0 != output[i]) {
+			std::cout << "i = " << i << ", output[i] = " << output[i] << std::endl;
+			conclusion = false;
+			break;
+		}
+	if (conclusion) {
+		std::cout << "OK" << std::endl;
+                return 0;
+	} else {
+		std::cout << "NOK" << std::endl;
+                return 1;
+        }
+}
+
+static unsigned int test_streamingMap(void)
+{
+	std::cout << "Test streamingMap: ";
+
+	ThreadCache cache(4);
+	static const int size = 10000;
+	static const size_t window = 8;
+	int produced = 0;
+	int consumed = 0;
+	int maxInFlight = 0;
+	bool ordered = true;
+	streamingMap<int>([&](int &item) {
+		if (size == produced)
+			return false;
+		item = produced++;
+		maxInFlight = std::max(maxInFlight, produced - consumed);
+		return true;
+	}, [](int i) { return std::to_string(i); }, [&](std::string s) {
+		ordered = ordered && std::to_string(consumed) == s;
+		consumed++;
+	}, window, cache);
+
+	std::istringstream stream("5 3 8 1 9 2 7");
+	std::vector<int> unordered;
+	streamingMap(std::istream_iterator<int>(stream), std::istream_iterator<int>(), [](int i) { return i * 10; },
+		[&unordered](int i) { unordered.push_back(i); }, 2, cache, streamOrder::UNORDERED);
+	std::sort(unordered.begin(), unordered.end());
+
+	std::vector<int> input(100);
+	std::iota(input.begin(), input.end(), 0);
+	int delivered = 0;
+	bool caught = false;
+	try {
+		streamingMap(input.begin(), input.end(), [](int i) {
+			if (50 == i)
+				throw std::runtime_error("item failed");
+			return i;
+		}, [&delivered](int) { delivered++; }, 4, cache);
+	}
+	catch (std::runtime_error &e) {
+		caught = true;
+	}
+
+	if (ordered && size == consumed && static_cast<int>(window) + 1 >= maxInFlight &&
+			std::vector<int> { 10, 20, 30, 50, 70, 80, 90 } == unordered && caught && 50 >= delivered) {
+		std::cout << "OK" << std::endl;
+                return 0;
+        } else {
+		std::cout << "NOK" << std::endl;
+                return 1;
+        }
+}
+
 static unsigned int test_associativeReduce(void)
 {
 	std::cout << "Test implementation of associativeReduce operator: ";
@@ -213,6 +1167,197 @@ static unsigned int test_associativeReduce_with_one_element(void)
         }
 }
 
+static unsigned int test_associativeReduce_keeps_order(void)
+{
+	std::cout << "Test associativeReduce operator keeps the order of the elements: ";
+
+	std::vector<std::string> v;
+	std::string expected("init");
+	ThreadCache cache(4);
+	for (int i = 0; i < 1000; i++) {
+		v.push_back(std::to_string(i));
+		expected += v.back();
+	}
+	const auto response = associativeReduce(v.begin(), v.end(), std::string("init"), [](std::string left, const std::string &right) { return left + right; }, cache);
+	if (expected == response) {
+		std::cout << "OK" << std::endl;
+                return 0;
+	} else {
+		std::cout << "NOK" << std::endl;
+                return 1;
+        }
+}
+
+static unsigned int test_transformReduce(void)
+{
+	std::cout << "Test transformReduce: ";
+
+	ThreadCache cache(4);
+	std::vector<int> v(10000);
+	std::iota(v.begin(), v.end(), 0);
+	const long squares = transformReduce(v.begin(), v.end(), 0L, [](int i) { return static_cast<long>(i) * i; },
+						[](long a, long b) { return a + b; }, cache);
+	std::string digits;
+	for (int i = 0; i < 200; i++)
+		digits += std::to_string(i % 10);
+	const std::string concatenated = transformReduce(v.begin(), v.begin() + 200, std::string(">"),
+						[](int i) { return std::to_string(i % 10); },
+						[](std::string a, const std::string &b) { return a + b; }, cache);
+	const std::vector<std::string> words { "apple", "avocado", "banana", "blueberry", "cherry", "apricot" };
+	const auto lengths = transformReduceByKey(words.begin(), words.end(), [](const std::string &w) { return w[0]; },
+						[](const std::string &w) { return w.size(); }, [](size_t a, size_t b) { return a + b; }, cache);
+	const int empty = transformReduce(v.begin(), v.begin(), 7, [](int i) { return i; }, [](int a, int b) { return a + b; }, cache);
+
+	if (333283335000L == squares && ">" + digits == concatenated && 3 == lengths.size() &&
+			19 == lengths.at('a') && 15 == lengths.at('b') && 6 == lengths.at('c') && 7 == empty) {
+		std::cout << "OK" << std::endl;
+                return 0;
+        } else {
+		std::cout << "NOK" << std::endl;
+                return 1;
+        }
+}
+
+static unsigned int test_commutativeReduce(void)
+{
+	std::cout << "Test implementation of commutativeReduce operator: ";
+
+	std::vector<long> v(1000000, 1);
+	ThreadCache cache(3);
+	const auto response = commutativeReduce(v.begin(), v.end(), 5L, [](long left, long right) { return left + right; }, cache, 1000);
+	const auto small = commutativeReduce(v.begin(), v.begin() + 2, 0L, [](long left, long right) { return left + right; }, cache, 1000);
+	if (1000005 == response && 2 == small) {
+		std::cout << "OK" << std::endl;
+                return 0;
+	} else {
+		std::cout << "NOK" << std::endl;
+                return 1;
+        }
+}
+static unsigned int test_scan_filter_partition(void)
+{
+	std::cout << "Test scan, filter and partition: ";
+
+	ThreadCache cache(4);
+	std::vector<int> v(1001);
+	std::iota(v.begin(), v.end(), -500);
+	const auto isEven = [](int i) { return 0 == i % 2; };
+
+	std::vector<int> inclusive(v.size()), expectedInclusive(v.size());
+	inclusiveScan(v.begin(), v.end(), inclusive.begin(), [](int a, int b) { return a + b; }, cache);
+	std::partial_sum(v.begin(), v.end(), expectedInclusive.begin());
+
+	std::vector<std::string> words { "a", "b", "c", "d", "e", "f", "g" };
+	std::vector<std::string> exclusive(words.size());
+	exclusiveScan(words.begin(), words.end(), exclusive.begin(), std::string(">"), [](const std::string &a, const std::string &b) { return a + b; }, cache);
+
+	std::vector<int> inPlace(v);
+	inclusiveScan(inPlace.begin(), inPlace.end(), inPlace.begin(), [](int a, int b) { return a + b; }, cache);
+
+	std::vector<int> filtered(v.size()), expectedFiltered;
+	filtered.erase(filter(v.begin(), v.end(), filtered.begin(), isEven, cache), filtered.end());
+	std::copy_if(v.begin(), v.end(), std::back_inserter(expectedFiltered), isEven);
+
+	std::vector<int> partitioned(v.size()), expectedPartitioned(v);
+	const auto point = partition(v.begin(), v.end(), partitioned.begin(), isEven, cache);
+	std::stable_partition(expectedPartitioned.begin(), expectedPartitioned.end(), isEven);
+
+	if (expectedInclusive == inclusive && expectedInclusive == inPlace && std::vector<std::string> { ">", ">a", ">ab", ">abc", ">abcd", ">abcde", ">abcdef" } == exclusive &&
+	    expectedFiltered == filtered && expectedPartitioned == partitioned && static_cast<size_t>(point - partitioned.begin()) == expectedFiltered.size()) {
+		std::cout << "OK" << std::endl;
+                return 0;
+        } else {
+		std::cout << "NOK" << std::endl;
+                return 1;
+        }
+}
+
+static unsigned int test_parallel_sort(void)
+{
+	std::cout << "Test parallel sort: ";
+
+	ThreadCache cache(4);
+	std::vector<int> v(100000), expected;
+	unsigned int seed = 42;
+	for (auto &e : v)
+		e = (seed = seed * 1103515245 + 12345) % 10000;
+	expected = v;
+	std::sort(expected.begin(), expected.end(), std::greater<int>());
+	parallelSort(v.begin(), v.end(), std::greater<int>(), cache);
+
+	std::vector<std::unique_ptr<std::pair<int, int>>> records;
+	for (int i = 0; i < 50000; i++)
+		records.push_back(std::make_unique<std::pair<int, int>>((i * 7919) % 100, i));
+	parallelStableSort(records.begin(), records.end(), [](const auto &a, const auto &b) { return a->first < b->first; }, cache);
+	bool stable = true;
+	for (size_t i = 1; i < records.size(); i++)
+		if (records[i - 1]->first > records[i]->first || (records[i - 1]->first == records[i]->first && records[i - 1]->second > records[i]->second))
+			stable = false;
+
+	/* Move-only and not default constructible. */
+	struct key {
+		explicit key(int k) : k(std::make_unique<int>(k)) { }
+		std::unique_ptr<int> k;
+	};
+	std::vector<key> keys;
+	for (int i = 0; i < 50000; i++)
+		keys.emplace_back((i * 7919) % 50000);
+	parallelSort(keys.begin(), keys.end(), [](const key &a, const key &b) { return *a.k < *b.k; }, cache);
+	bool keysSorted = true;
+	for (int i = 0; i < 50000; i++)
+		keysSorted = keysSorted && i == *keys[i].k;
+
+	std::vector<int> small { 3, 1, 2 };
+	parallelSort(small.begin(), small.end(), cache);
+
+	if (expected == v && stable && 50000 == records.size() && keysSorted && std::vector<int> { 1, 2, 3 } == small) {
+		std::cout << "OK" << std::endl;
+                return 0;
+        } else {
+		std::cout << "NOK" << std::endl;
+                return 1;
+        }
+}
+
+static unsigned int test_executor_submit(void)
+{
+	std::cout << "Test executor submit returns futures: ";
+
+	bool conclusion = true;
+	ThreadCache cache(4);
+	Executor executor(4, 64, cache);
+	std::vector<future<int>> results;
+	for (int i = 0; i < 1000; i++)
+		results.push_back(executor.submit([](int a, int b) { return a * b; }, i, 2));
+	std::atomic<int> called {0};
+	auto nothing = executor.submit([&called]() { called++; });
+	auto failure = executor.submit([]() -> std::string { throw std::runtime_error("failure"); });
+	auto moved = executor.submit([](std::unique_ptr<int> p) { return *p; }, std::make_unique<int>(42));
+
+	for (int i = 0; i < 1000; i++)
+		conclusion = conclusion && (2 * i == results[i].get());
+	nothing.get();
+	try {
+		failure.get();
+		conclusion = false;
+	}
+	catch (std::runtime_error &e) { }
+	conclusion = conclusion && (1 == called) && (42 == moved.get()) && !moved.valid();
+	future<std::string> outliving;
+	{
+		ThreadCache shortCache(2);
+		Executor shortLived(2, 8, shortCache);
+		outliving = shortLived.submit([]() { return std::string(300, 'x'); });
+	}
+	conclusion = conclusion && (300 == outliving.get().size());
+	if (conclusion) {
+		std::cout << "OK" << std::endl;
+                return 0;
+	} else {
+		std::cout << "NOK" << std::endl;
+                return 1;
+        }
+}
 
 typedef unsigned int (*test_t)(void);
 static unsigned int execute_tests(const test_t tests[]) {
@@ -230,12 +1375,45 @@ int main()
 	        executeThreadPool__no_thread_context,
 	        executeThreadPool__init_and_final,
 	        executeThreadPool__use_external_thread_cache,
+	        executeThreadPool__lock_free_queue,
+	        test_lockFreeQueue_drain_on_terminate,
+	        executeThreadPool__work_stealing,
+	        executeThreadPool__work_stealing_overflow,
+	        executeThreadPool__batches_thread_safe_queue,
+	        executeThreadPool__batches_lock_free_queue,
+	        executeThreadPool__batches_work_stealing,
+	        executeStaticThreadPool,
+	        test_fork_join,
+	        test_task_graph,
+	        test_task_graph_destroyed_after_run,
+	        test_pipeline,
+#ifdef THREADPOOL_COROUTINES
+	        test_coroutines,
+#endif
+	        test_elastic_thread_cache,
+	        test_partial_thread_acquisition,
+	        test_thread_placement,
+	        test_spin_then_park,
+	        test_priority_and_deadline_queues,
+	        test_metrics,
+	        test_overflow_policies,
+	        test_wait_and_reuse,
+	        test_worker_context_and_arena,
 
 	        test_map_in_place,
 	        test_map,
 	        test_map_with_pointers,
+	        test_forEach_schedules,
+	        test_map_range,
+	        test_streamingMap,
 	        test_associativeReduce,
 	        test_associativeReduce_with_one_element,
+	        test_associativeReduce_keeps_order,
+	        test_commutativeReduce,
+	        test_transformReduce,
+	        test_scan_filter_partition,
+	        test_parallel_sort,
+	        test_executor_submit,
        	        nullptr,
         };
 	return execute_tests(tests);